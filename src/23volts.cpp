@@ -9,6 +9,7 @@ void init(Plugin *p) {
 
 	p->addModel(modelCells);
 	p->addModel(modelClockM8);
+	p->addModel(modelM8X);
 	p->addModel(modelMem);
 	p->addModel(modelMerge4);
 	p->addModel(modelMerge8);
@@ -8,6 +8,7 @@ extern Plugin *pluginInstance;
 // Declare each Model, defined in each module source file
 extern Model* modelCells;
 extern Model* modelClockM8;
+extern Model* modelM8X;
 extern Model* modelMem;
 extern Model* modelMerge4;
 extern Model* modelMerge8;
@@ -6,15 +6,40 @@
 #include "widgets/ports.hpp"
 #include "M8.hpp"
 
+using simd::float_4;
+
 struct ClockFollower {
 
 	static const int CLOCK_DRIFT_THRESEHOLD = 5;
 	static const int CLOCK_STOP_THRESEHOLD = 1000;
+	static const int HISTORY_SIZE = 8;
+	static const int MEDIAN_SIZE = 5;
+
+	// How the clock duration is estimated from the incoming intervals
+	enum TrackingModes {
+		TRACK_LAST,
+		TRACK_AVERAGE,
+		TRACK_MEDIAN,
+		TRACK_PLL,
+		NUM_TRACKING_MODES
+	};
 
 	int m_samplerate;
 	bool isRunning = false;
 	bool isLearning = true;
 	bool isTicking = false;
+	bool isLocked = false;
+
+	int trackingMode = TRACK_LAST;
+
+	// Last intervals, for average & median tracking
+	uint64_t m_intervals[HISTORY_SIZE];
+	int m_intervalCount = 0;
+	int m_intervalIndex = 0;
+
+	// Second order PLL state, in samples
+	double m_pllPeriod = 0.0;
+	double m_pllNextTick = 0.0;
 
 	uint64_t m_sampleCounter = 0;
 	uint64_t m_lastClockTick = 0;
@@ -26,7 +51,7 @@ struct ClockFollower {
 		isTicking = true;
 
 		if(isRunning) {
-			m_duration = m_sampleCounter - m_lastClockTick;
+			m_duration = estimateDuration(m_sampleCounter - m_lastClockTick);
 			isLearning = false;
 			m_nextExpectedClockTick = m_sampleCounter + m_duration;
 			m_overdueCounter = 0;
@@ -47,6 +72,80 @@ struct ClockFollower {
 
 	void start() {
 		isLearning = true;
+		resetTracking();
+	}
+
+	void resetTracking() {
+		m_intervalCount = 0;
+		m_intervalIndex = 0;
+		m_pllPeriod = 0.0;
+		isLocked = false;
+	}
+
+	// Only runs on ticks, step() stays as cheap as with TRACK_LAST
+	uint64_t estimateDuration(uint64_t interval) {
+		double estimate = interval;
+
+		// Locked while intervals stay within 2% of the previous estimate
+		isLocked = m_duration > 0 && std::fabs((double) interval - m_duration) <= m_duration * 0.02;
+
+		// A tempo change resets the history instead of slowly sliding to it
+		if(m_duration > 0 && (interval > m_duration * 1.5 || interval < m_duration * 0.5)) {
+			resetTracking();
+		}
+
+		switch(trackingMode) {
+			case TRACK_AVERAGE:
+			case TRACK_MEDIAN:
+				m_intervals[m_intervalIndex] = interval;
+				m_intervalIndex = (m_intervalIndex + 1) % HISTORY_SIZE;
+				if(m_intervalCount < HISTORY_SIZE) m_intervalCount++;
+				estimate = trackingMode == TRACK_AVERAGE ? getAverageInterval() : getMedianInterval();
+				break;
+			case TRACK_PLL:
+				estimate = trackPhase(interval);
+				break;
+		}
+
+		return (uint64_t) std::round(estimate);
+	}
+
+	double getAverageInterval() {
+		uint64_t sum = 0;
+		for(int x = 0; x < m_intervalCount; x++) {
+			sum += m_intervals[x];
+		}
+		return sum / (double) m_intervalCount;
+	}
+
+	double getMedianInterval() {
+		int count = std::min(m_intervalCount, MEDIAN_SIZE);
+		uint64_t values[MEDIAN_SIZE];
+		for(int x = 0; x < count; x++) {
+			values[x] = m_intervals[(m_intervalIndex - 1 - x + HISTORY_SIZE) % HISTORY_SIZE];
+		}
+		std::sort(values, values + count);
+		return values[count / 2];
+	}
+
+	double trackPhase(uint64_t interval) {
+		const double alpha = 0.3; // Phase correction
+		const double beta = 0.05; // Period correction
+
+		if(m_pllPeriod <= 0.0) {
+			m_pllPeriod = interval;
+			m_pllNextTick = m_sampleCounter + m_pllPeriod;
+			return m_pllPeriod;
+		}
+
+		double error = m_sampleCounter - m_pllNextTick;
+		m_pllPeriod += beta * error;
+		m_pllNextTick += m_pllPeriod + alpha * error;
+		return m_pllPeriod;
+	}
+
+	float getBpm() {
+		return m_duration > 0 ? 60.f * m_samplerate / m_duration : 0.f;
 	}
 
 	void restart() {
@@ -68,8 +167,32 @@ struct ClockFollower {
 		}
 	}
 
+	// Same as calling step() n times, when no tick happens in between
+	void advance(uint64_t n) {
+		isTicking = false;
+		uint64_t counter = m_sampleCounter + n;
+
+		if(isRunning && counter > m_nextExpectedClockTick) {
+			m_overdueCounter += counter - std::max(m_sampleCounter, m_nextExpectedClockTick);
+
+			if(m_overdueCounter > CLOCK_STOP_THRESEHOLD && ! isLearning) {
+				stop();
+			}
+		}
+		m_sampleCounter = counter;
+	}
+
+	// Number of steps until the follower stops on its own, 0 if it won't
+	uint64_t getSamplesToEvent() {
+		if(! isRunning || isLearning || m_overdueCounter > CLOCK_STOP_THRESEHOLD) return 0;
+
+		uint64_t overdue = m_nextExpectedClockTick >= m_sampleCounter ? m_nextExpectedClockTick - m_sampleCounter + 1 : 1;
+		return overdue + CLOCK_STOP_THRESEHOLD - m_overdueCounter;
+	}
+
 	void stop() {
 		isRunning = false;
+		isLocked = false;
 	}
 
 	void updateSamplerate(float samplerate) {
@@ -117,13 +240,16 @@ struct ClockModulator {
 
 	int pulseMode = MODE_GATE;
 
+	// When enabled, multiplied pulses are placed from the exact fractional
+	// interval instead of a whole number of samples, so they don't drift
+	// between two input ticks
+	bool phaseAccurate = false;
+
 	bool isRunning = false;
 
 	float m_samplerate;
 	float m_ratio = 1.f;
 
-	std::string ratioLitteral = "x1";
-
 	uint64_t m_sampleCounter = 0; // Since last reset which will be t=0
 	uint64_t m_nextpulse = 0;
 
@@ -135,6 +261,8 @@ struct ClockModulator {
 	dsp::PulseGenerator clockPulse;
 	ClockFollower* m_clockFollower;
 
+	float m_value = 0.f; // Last output value
+
 	bool setRatio(float ratio) {
 		bool ratioChanged = false;
 		if(ratio != m_ratio) {
@@ -150,10 +278,6 @@ struct ClockModulator {
 		return ratioChanged;
 	}
 
-	void setRatioLiterral(std::string ratio) {
-		ratioLitteral = ratio;
-	}
-
 	float getRatio() const {
 		return m_ratio;
 	}
@@ -198,6 +322,11 @@ struct ClockModulator {
 		uint64_t duration = getIntervalDuration();
 		if(duration <= 0 ||m_ratio == 1.f) return;
 
+		if(phaseAccurate) {
+			computeNextPulsePhase(tickDuration);
+			return;
+		}
+
 		float remaining = getRemainingDivisionTick(m_tick_counter - 1);
 
 		if(remaining < 1) {
@@ -217,6 +346,28 @@ struct ClockModulator {
 		}
 	}
 
+	// Same as computeNextPulse, in double precision and without rounding the
+	// interval, pulses land on the first sample at or after their exact time
+	void computeNextPulsePhase(uint64_t tickDuration) {
+		double elapsedDivisions = (m_tick_counter - 1) * (double) m_ratio;
+		double remaining = (1.0 - (elapsedDivisions - std::floor(elapsedDivisions))) / m_ratio;
+
+		if(remaining < 1.0) {
+			double interval = tickDuration / (double) m_ratio;
+			double firstPulse = m_lastClockTick + remaining * tickDuration;
+			double nextPulse = firstPulse;
+
+			if(m_sampleCounter >= firstPulse) {
+				double elapsed = std::floor((m_sampleCounter - firstPulse) / interval);
+				nextPulse = firstPulse + (elapsed + 1.0) * interval;
+			}
+			m_nextpulse = (uint64_t) std::ceil(nextPulse);
+		}
+		else {
+			m_nextpulse = 0; // Just wait for next tick to pulse/compute
+		}
+	}
+
 	void setClockFollower(ClockFollower* clockFollower) {
 		m_clockFollower = clockFollower;
 		computeNextPulse();
@@ -268,7 +419,37 @@ struct ClockModulator {
 	}
 
 	float getValue() {
-		return clockPulse.process(1.0f) ? 10.f : 0.f;
+		m_value = clockPulse.process(1.0f) ? 10.f : 0.f;
+		return m_value;
+	}
+
+	// Same as calling step() and getValue() n times, when the follower
+	// doesn't tick and no pulse starts or ends in between
+	void advance(uint64_t n) {
+		m_sampleCounter += n;
+		isRunning = m_clockFollower->isRunning;
+
+		if(clockPulse.remaining > 0.f) {
+			clockPulse.remaining -= std::min((float) n, std::ceil(clockPulse.remaining));
+		}
+	}
+
+	// Number of steps until a pulse starts or ends, 0 if none is scheduled
+	uint64_t getSamplesToEvent() {
+		uint64_t samples = 0;
+		if(m_clockFollower->isRunning && m_nextpulse > m_sampleCounter) {
+			samples = m_nextpulse - m_sampleCounter;
+		}
+		// The output goes low on the first getValue() called with nothing remaining
+		uint64_t pulseEnd = 0;
+		if(clockPulse.remaining > 0.f) {
+			pulseEnd = std::ceil(clockPulse.remaining) + 1;
+		}
+		else if(m_value > 0.f) {
+			pulseEnd = 1;
+		}
+		if(pulseEnd > 0 && (samples == 0 || pulseEnd < samples)) samples = pulseEnd;
+		return samples;
 	}
 
 	void updateSamplerate(float samplerate) {
@@ -283,7 +464,6 @@ struct ClockModulator {
 		json_object_set_new(rootJ, "is_running", json_boolean(isRunning));
 		json_object_set_new(rootJ, "ratio", json_real(m_ratio));
 		json_object_set_new(rootJ, "reset_tick", json_real(m_reset_tick));
-		json_object_set_new(rootJ, "ratio_litteral", json_string(ratioLitteral.c_str()));
 		json_object_set_new(rootJ, "sample_counter", json_integer(m_sampleCounter));
 		json_object_set_new(rootJ, "next_pulse", json_integer(m_nextpulse));
 		json_object_set_new(rootJ, "tick_counter", json_integer(m_tick_counter));
@@ -296,7 +476,6 @@ struct ClockModulator {
 		isRunning = json_is_true(json_object_get(rootJ, "is_running"));
 		m_ratio = json_real_value(json_object_get(rootJ, "ratio"));
 		m_reset_tick = json_real_value(json_object_get(rootJ, "reset_tick"));
-		ratioLitteral = json_string_value(json_object_get(rootJ, "ratio_litteral"));
 		m_sampleCounter = json_integer_value(json_object_get(rootJ, "sample_counter"));
 		m_nextpulse = json_integer_value(json_object_get(rootJ, "next_pulse"));
 		m_tick_counter = json_integer_value(json_object_get(rootJ, "tick_counter"));
@@ -304,9 +483,150 @@ struct ClockModulator {
 	}
 };
 
+// Ratios available for each combination of the quantize buttons. Built once,
+// when the first ClockM8 is created, and shared by every ClockM8 : the audio
+// thread only swaps table pointers and channel litterals point into
+// immutable strings.
+// The tables are computed rather than constexpr, as the plugin builds as
+// C++11 where constexpr functions are a single return statement, and the
+// litterals are std::string.
+struct ClockRatioTables {
+	static const int MAX_RATIOS = 48;
+
+	enum Quantizers {
+		BINARY = 1,
+		TERNARY = 2,
+		ODD = 4,
+		DOTTED = 8,
+		QUANTIZER_COMBINATIONS = 16
+	};
+
+	// Indexes in ratios, sorted by ratio
+	struct Table {
+		int multiplicators[MAX_RATIOS];
+		int multiplicatorsCount = 0;
+		int dividers[MAX_RATIOS];
+		int dividersCount = 0;
+	};
+
+	// Every ratio the quantizers can produce, sorted, with their display litterals
+	float ratios[MAX_RATIOS];
+	int ratiosCount = 0;
+	std::string multiplyLitterals[MAX_RATIOS];
+	std::string divideLitterals[MAX_RATIOS];
+
+	Table tables[QUANTIZER_COMBINATIONS];
+
+	static const ClockRatioTables& get() {
+		static const ClockRatioTables instance;
+		return instance;
+	}
+
+	ClockRatioTables() {
+		const float binaryValues[9] = {1, 2, 4, 8, 16, 32, 64, 128, 256};
+		const float ternaryValues[7] = {3, 6, 12, 24, 48, 96, 192};
+		const float dottedBinaryMultiplicators[1] = {1.f/ (3.f/4.f)};
+		const float dottedTernaryMultiplicators[2] = {1.5f, 2};
+		const float dottedOddMultiplicators[1] = {2.5f};
+		const float dottedBinaryDividers[8] = {1.5f, 3, 6, 12, 24, 48, 96, 192};
+		const float dottedTernaryDividers[1] = {2.5f}; 
+		const float oddValues[8] = {5,7,9,10,11,13,14,15};
+
+		addRatios(binaryValues, 9);
+		addRatios(ternaryValues, 7);
+		addRatios(dottedBinaryMultiplicators, 1);
+		addRatios(dottedTernaryMultiplicators, 2);
+		addRatios(dottedOddMultiplicators, 1);
+		addRatios(dottedBinaryDividers, 8);
+		addRatios(dottedTernaryDividers, 1);
+		addRatios(oddValues, 8);
+		std::sort(ratios, ratios + ratiosCount);
+
+		for(int i = 0; i < ratiosCount; i++) {
+			float ratio = ratios[i];
+			std::string ratioStr = hasDecimals(ratio) ? roundedLitteral(ratio, 2) : std::to_string((int)ratio);
+			multiplyLitterals[i] = ratio == 1 ? "x1" : "x" + ratioStr;
+			divideLitterals[i] = ratio == 1 ? "x1" : "/" + ratioStr;
+		}
+
+		for(int mask = 0; mask < QUANTIZER_COMBINATIONS; mask++) {
+			bool binary = mask & BINARY;
+			bool ternary = mask & TERNARY;
+			bool odd = mask & ODD;
+			bool dotted = mask & DOTTED;
+
+			bool multiplicators[MAX_RATIOS] = {};
+			bool dividers[MAX_RATIOS] = {};
+
+			if(binary) {
+				enableRatios(multiplicators, binaryValues, 9);
+				enableRatios(dividers, binaryValues, 9);
+			}
+			if(ternary) {
+				enableRatios(multiplicators, ternaryValues, 7);
+				enableRatios(dividers, ternaryValues, 7);
+			}
+			if(dotted && binary) {
+				enableRatios(multiplicators, dottedBinaryMultiplicators, 1);
+				enableRatios(dividers, dottedBinaryDividers, 8);
+			}
+			if(dotted && ternary) {
+				enableRatios(multiplicators, dottedTernaryMultiplicators, 2);
+				enableRatios(dividers, dottedTernaryDividers, 1);
+			}
+			if(dotted && odd) {
+				enableRatios(multiplicators, dottedOddMultiplicators, 1);
+			}
+			if(odd) {
+				enableRatios(multiplicators, oddValues, 8);
+				enableRatios(dividers, oddValues, 8);
+			}
+
+			// Always have X1 even if no quantization is selected
+			multiplicators[getRatioIndex(1.f)] = true;
+			dividers[getRatioIndex(1.f)] = true;
+
+			Table* table = &tables[mask];
+			for(int i = 0; i < ratiosCount; i++) {
+				if(multiplicators[i]) table->multiplicators[table->multiplicatorsCount++] = i;
+				if(dividers[i]) table->dividers[table->dividersCount++] = i;
+			}
+		}
+	}
+
+	int getRatioIndex(float ratio) const {
+		for(int i = 0; i < ratiosCount; i++) {
+			if(ratios[i] == ratio) return i;
+		}
+		return 0;
+	}
+
+	void addRatios(const float* values, int count) {
+		for(int x = 0; x < count; x++) {
+			bool exists = false;
+			for(int i = 0; i < ratiosCount; i++) {
+				if(ratios[i] == values[x]) exists = true;
+			}
+			if(! exists) ratios[ratiosCount++] = values[x];
+		}
+	}
+
+	void enableRatios(bool* enabled, const float* values, int count) {
+		for(int x = 0; x < count; x++) {
+			enabled[getRatioIndex(values[x])] = true;
+		}
+	}
+
+	std::string roundedLitteral(float ratio, int precision) {
+		return std::to_string(ratio).substr(0, std::to_string(ratio).find(".") + precision + 1);
+	}
+};
+
 struct ClockM8 : M8Module {
 
 	static const int POLY_CHANNELS = 16;
+	static const int CHANNEL_GROUPS = POLY_CHANNELS / 4;
+	static constexpr float RATIO_HYSTERESIS = 0.05f;
 
 	enum ParamIds {
 		ATTENUATOR_KNOB,
@@ -347,43 +667,54 @@ struct ClockM8 : M8Module {
 	ClockModulator clockModulators[M8_POLY_CHANNELS];
 	ClockFollower clockFollowers[M8_POLY_CHANNELS];
 
+	// Clock channels carrying the same clock as a lower channel use its
+	// follower instead of stepping their own, until their ticks diverge
+	int followerSources[M8_POLY_CHANNELS];
+	int sharedFollowersMask = 0;
+
 	float parameters[POLY_CHANNELS]; // Added for expanders
 	float modulations[POLY_CHANNELS];
+	float offsets[POLY_CHANNELS];
+
+	// Offset range of the ratio each channel is currently set to, the ratio
+	// is only looked up again when the offset leaves it by RATIO_HYSTERESIS
+	float ratioLows[POLY_CHANNELS];
+	float ratioHighs[POLY_CHANNELS];
+
+	// Expander controls currently applied to channelControls
+	float controlsKnobValue = NAN;
+	int controlledBanks = 0;
+	int controlledChannels = 0;
+	uint32_t controlsReceivedSequence = 0;
 
 	int clockChannels = -1; 
 	int modChannels = -1; 
 	int resetChannels = -1; 
 	int outputChannels = -1;
 
-	dsp::SchmittTrigger resetTriggers[M8_POLY_CHANNELS];
-	dsp::SchmittTrigger clockTriggers[M8_POLY_CHANNELS];
+	// Edge detection runs on 4 channels at once
+	dsp::TSchmittTrigger<float_4> resetTriggers[CHANNEL_GROUPS];
+	dsp::TSchmittTrigger<float_4> clockTriggers[CHANNEL_GROUPS];
 
 	bool quantizeBinary = true;
 	bool quantizeTernary = false;
 	bool quantizeOdd = false;
 	bool quantizeDotted = true;
 
-	const float binaryValues[9] = {1, 2, 4, 8, 16, 32, 64, 128, 256};
-	const float ternaryValues[7] = {3, 6, 12, 24, 48, 96, 192};
-	const float dottedBinaryMultiplicators[1] = {1.f/ (3.f/4.f)};
-	const float dottedTernaryMultiplicators[2] = {1.5f, 2};
-	const float dottedOddMultiplicators[1] = {2.5f};
-	const float dottedBinaryDividers[8] = {1.5f, 3, 6, 12, 24, 48, 96, 192};
-	const float dottedTernaryDividers[1] = {2.5f}; 
-	const float oddValues[8] = {5,7,9,10,11,13,14,15};
-	int BINARY_VALUES_COUNT = 9;
-	int TERNARY_VALUES_COUNT = 7;
-	int DOTTED_BIN_MULT_COUNT = 1;
-	int DOTTED_TER_MULT_COUNT = 2;
-	int DOTTED_ODD_MULT_COUNT = 1;
-	int DOTTED_BIN_DIV_COUNT = 8;
-	int DOTTED_TER_DIV_COUNT = 1;
-	int ODD_VALUES_COUNT = 8;
-
 	int outputMode = ClockModulator::MODE_GATE;
+	bool phaseAccurate = false;
+
+	// In event driven mode, samples where nothing can happen only count how
+	// many steps the followers and modulators are behind
+	bool eventDriven = false;
+	uint64_t skippedSamples = 0;
+	uint64_t samplesToNextEvent = 0;
+	int trackingMode = ClockFollower::TRACK_LAST;
+
+	// Ratio tables of the current quantize buttons combination
+	const ClockRatioTables* ratioTables;
+	const ClockRatioTables::Table* currentRatios;
 
-	std::vector<float> currentMultiplicators;
-	std::vector<float> currentDividers;
 
 
 	ClockM8() {
@@ -405,12 +736,17 @@ struct ClockM8 : M8Module {
 
 		samplerate = APP->engine->getSampleRate();
 		onSampleRateChange();	
+		ratioTables = &ClockRatioTables::get();
 		updateCurrentRatios();
 
 		for(int x = 0; x < M8_POLY_CHANNELS; x++) {
-			channelLitterals[x] = &clockModulators[x].ratioLitteral;
+			followerSources[x] = x;
+			channelLitterals[x] = &ratioTables->multiplyLitterals[ratioTables->getRatioIndex(1.f)];
+			modulations[x] = 0.0f;
+			channelOutputs[x] = 0.0f;
 			channelControls[x] = 0.0f;
 		} 
+		publishLitterals();
 	}
 
 	void process(const ProcessArgs& args) override {
@@ -418,21 +754,13 @@ struct ClockM8 : M8Module {
 
 		if(connectionUpdater.process()) updateConnections();
 		if(channelUpdater.process()) updateChannels();
-		if(ratioUpdater.process()) updateRatios();
-
-		if(rightLinkActive && statusMessage->moduleType == M8_EXPANDER) {
-			if(controlMessage->bankA == true) {
-				for(int x = 0; x < 8; x++) {
-					//
-				}
-			}
-			if(controlMessage->bankB == true) {
-				for(int x = 8; x < 16; x++) {
-
-				}
-			}
+		if(ratioUpdater.process()) {
+			updateRatios();
+			publishLitterals();
 		}
 
+		updateControls();
+
 		// The number of outputs channel will be defined by the number
 		// of channels from the 3 inputs : Clock, Reset, Mod. Whichever
 		// is the biggest defines the number of outputs. Missing voices
@@ -444,101 +772,200 @@ struct ClockM8 : M8Module {
 		// The number of active clock dividers is defined by the number
 		// of clock output channels.
 
+
+		// Bit c is set when channel c received a trigger on this sample
+		int resetMask = resetChannels > 0 ? expandMask(detectTriggers(inputs[RESET_INPUT], resetTriggers, resetChannels), resetChannels) : 0;
+		int clockMask = clockChannels > 0 ? detectTriggers(inputs[CLOCK_INPUT], clockTriggers, clockChannels) : 0;
 		
+		int ratioMask = outputChannels > 0 ? detectRatioChanges() : 0;
+
+		if(eventDriven && ! resetMask && ! clockMask && ! ratioMask && skippedSamples + 1 < samplesToNextEvent) {
+			skippedSamples++;
+			sendMessages();
+			return;
+		}
+		if(skippedSamples > 0) catchUp();
+
 		for(int c = 0; c < outputChannels; c++) {
 			// Process resets. 
-			int r = c < resetChannels ? c : resetChannels - 1;
-
-			if(resetTriggers[r].process(inputs[RESET_INPUT].getVoltage(r))) {
+			if(resetMask & (1 << c)) {
 				clockModulators[c].reset();
 			}
+		}
 
-			int m = c < modChannels ? c : modChannels - 1;
-
-			// Return an offseted value of the main knob
-			float offset = getModulatedParameter(m);
-
-			float ratio = getQuantizedRatio(offset);
-			
-			if(clockModulators[c].setRatio(ratio)) { 
-				std::string litteral = getQuantizedRatioLitteral(offset);
-				clockModulators[c].setRatioLiterral(litteral);
-			}
+		while(ratioMask) {
+			int c = __builtin_ctz(ratioMask);
+			ratioMask &= ratioMask - 1;
+			updateChannelRatio(c, offsets[c]);
 		}
 
+		if(clockMask && sharedFollowersMask) checkSharedFollowers(clockMask);
+
 		// Step clock followers
-		for(int c = 0; c < clockChannels; c++) {
+		int activeFollowers = clockChannels > 0 ? ((1 << clockChannels) - 1) & ~sharedFollowersMask : 0;
+		while(activeFollowers) {
+			int c = __builtin_ctz(activeFollowers);
+			activeFollowers &= activeFollowers - 1;
+
 			clockFollowers[c].step();
 
-			if(clockTriggers[c].process(inputs[CLOCK_INPUT].getVoltage(c))) {
+			if(clockMask & (1 << c)) {
 				clockFollowers[c].tick();
 			}
 		}
 
-		// Process Outputs
+		// Process Outputs, the pulse generators must only be processed once per sample
+		bool outputsChanged = false;
 		for(int c = 0; c < outputChannels; c++) {
 			clockModulators[c].step();
-			outputs[CLOCK_OUTPUT].setVoltage(clockModulators[c].getValue(), c);
+			float value = clockModulators[c].getValue();
+			if(value != channelOutputs[c]) {
+				channelOutputs[c] = value;
+				outputsChanged = true;
+			}
 		}
+		if(outputsChanged) markOutputsChanged();
+		writeOutputs();
 
+		if(eventDriven) samplesToNextEvent = getSamplesToNextEvent();
 
-		if(rightLinkActive) {
-			for(int c = 0; c < outputChannels; c++) {
-				channelOutputs[c] = clockModulators[c].getValue();
-			}
-			sendStatusMessage();
+		sendMessages();
+	}
+
+	void writeOutputs() {
+		for(int c = 0; c < outputChannels; c += 4) {
+			outputs[CLOCK_OUTPUT].setVoltageSimd(float_4::load(&channelOutputs[c]), c);
 		}
 	}
 
-	float getModulatedParameter(int modulationChannel) {
-		float knobValue = params[MAIN_KNOB].getValue();
-		float attenuatedModulation = getAttenuatedModulation(modulationChannel);
-		return clamp(knobValue + attenuatedModulation, -10.f, 10.f);
+	// Returns a bitmask of the channels that crossed the trigger threshold
+	int detectTriggers(Input& input, dsp::TSchmittTrigger<float_4>* triggers, int channels) {
+		int mask = 0;
+		for(int c = 0; c < channels; c += 4) {
+			float_4 triggered = triggers[c / 4].process(input.getVoltageSimd<float_4>(c));
+			mask |= simd::movemask(triggered) << c;
+		}
+		return mask & ((1 << channels) - 1);
 	}
 
-	float getAttenuatedModulation(int modulationChannel) {
-		if(modulationChannel > (modChannels +1)) {
-			return 0.f;
-		} 
+	// Copy the last input channel to the missing output channels
+	int expandMask(int mask, int channels) {
+		if(channels < outputChannels && (mask & (1 << (channels - 1)))) {
+			mask |= ((1 << outputChannels) - 1) & ~((1 << channels) - 1);
+		}
+		return mask;
+	}
 
-		float modulation = inputs[MOD_CV_INPUT].getVoltage(modulationChannel);
+	// Returns a bitmask of the channels whose ratio must be looked up again
+	int detectRatioChanges() {
 		float attenuation = params[ATTENUATOR_KNOB].getValue();
-		return modulation * attenuation;
+		int mask = 0;
+
+		for(int c = 0; c < outputChannels; c += 4) {
+			float_4 offset = simd::clamp(float_4::load(&channelControls[c]) + getModulations(c) * attenuation, -10.f, 10.f);
+			offset.store(&offsets[c]);
+
+			float_4 moved = (offset < float_4::load(&ratioLows[c]) - RATIO_HYSTERESIS) | (offset > float_4::load(&ratioHighs[c]) + RATIO_HYSTERESIS);
+			mask |= simd::movemask(moved) << c;
+		}
+
+		return mask & ((1 << outputChannels) - 1);
 	}
 
+	// Bring followers and modulators up to date with the skipped samples
+	void catchUp() {
+		int activeFollowers = clockChannels > 0 ? ((1 << clockChannels) - 1) & ~sharedFollowersMask : 0;
+		while(activeFollowers) {
+			int c = __builtin_ctz(activeFollowers);
+			activeFollowers &= activeFollowers - 1;
+			clockFollowers[c].advance(skippedSamples);
+		}
+		for(int c = 0; c < outputChannels; c++) {
+			clockModulators[c].advance(skippedSamples);
+		}
+		skippedSamples = 0;
+	}
 
-	float getQuantizedRatio(float offset) {
-		float ratio = getRawRatio(offset);
+	// Samples until the next pulse start or end, or a follower stop
+	uint64_t getSamplesToNextEvent() {
+		uint64_t next = UINT64_MAX;
 
-		if(offset >= 0.f) {
-			return ratio;
+		int activeFollowers = clockChannels > 0 ? ((1 << clockChannels) - 1) & ~sharedFollowersMask : 0;
+		while(activeFollowers) {
+			int c = __builtin_ctz(activeFollowers);
+			activeFollowers &= activeFollowers - 1;
+			uint64_t samples = clockFollowers[c].getSamplesToEvent();
+			if(samples > 0 && samples < next) next = samples;
 		}
-		else {
-			return 1.f / ratio;
+		for(int c = 0; c < outputChannels; c++) {
+			uint64_t samples = clockModulators[c].getSamplesToEvent();
+			if(samples > 0 && samples < next) next = samples;
 		}
+
+		return next;
 	}
 
-	std::string getQuantizedRatioLitteral(float offset) {
-		float ratio = getRawRatio(offset);
-		std::string ratioStr = hasDecimals(ratio) ? roundedLitteral(ratio, 2) : std::to_string((int)ratio) ;
-		std::string litteral = ratio == 1 ? "x1" : offset >= 0.f ? "x" + ratioStr : "/" + ratioStr;
-		return litteral;
+	// Channels of a bank controlled by an M8X expander follow its knobs
+	// instead of the main knob. Only refreshed when one of them moved.
+	void updateControls() {
+		float knobValue = params[MAIN_KNOB].getValue();
+		const M8ControlMessage& control = rightLinkActive && rightExpanderType == M8_EXPANDER ? *controlMessage : getEmptyMessage().control;
+		int banks = (control.bankA ? 1 : 0) | (control.bankB ? 2 : 0);
+
+		if(knobValue == controlsKnobValue && banks == controlledBanks && control.sequence == controlsReceivedSequence) return;
+		controlsKnobValue = knobValue;
+		controlledBanks = banks;
+		controlsReceivedSequence = control.sequence;
+		controlledChannels = control.bankB ? POLY_CHANNELS : control.bankA ? POLY_CHANNELS / 2 : 0;
+
+		bool changed = false;
+		for(int c = 0; c < POLY_CHANNELS; c++) {
+			float value = (banks & (c < POLY_CHANNELS / 2 ? 1 : 2)) ? control.controllerValues[c] : knobValue;
+			if(value != channelControls[c]) {
+				channelControls[c] = value;
+				changed = true;
+			}
+		}
+		// Echoed back in the status message for the expanders display
+		if(changed) markControlsChanged();
 	}
 
-	std::string roundedLitteral(float ratio, int precision) {
-		return std::to_string(ratio).substr(0, std::to_string(ratio).find(".") + precision + 1);
+	// Modulation of 4 channels starting at c, missing channels are copied
+	// from the last modulation channel
+	float_4 getModulations(int c) {
+		if(modChannels <= 0) return 0.f;
+		if(c + 4 <= modChannels) return inputs[MOD_CV_INPUT].getVoltageSimd<float_4>(c);
+
+		for(int x = c; x < c + 4; x++) {
+			modulations[x] = inputs[MOD_CV_INPUT].getVoltage(x < modChannels ? x : modChannels - 1);
+		}
+		return float_4::load(&modulations[c]);
 	}
 
-	// Returns raw ratio for the offset
-	float getRawRatio(float offset) {
-		int index = getRatioIndex(offset);
-		return offset >= 0 ? currentMultiplicators[index] : currentDividers[index];
+	void updateChannelRatio(int c, float offset) {
+		bool multiply = offset >= 0.f;
+		int size = multiply ? currentRatios->multiplicatorsCount : currentRatios->dividersCount;
+		float value = std::fabs(offset);
+		int index = value > 0 ? std::ceil((value / 10.f) * size) - 1 : 0;
+		index = clamp(index, 0, size - 1);
+
+		float range = 10.f / size;
+		ratioLows[c] = multiply ? index * range : -(index + 1) * range;
+		ratioHighs[c] = multiply ? (index + 1) * range : -index * range;
+
+		int ratioIndex = multiply ? currentRatios->multiplicators[index] : currentRatios->dividers[index];
+		float ratio = ratioTables->ratios[ratioIndex];
+		// Litteral first, the display only reads it when it sees a new ratio
+		channelLitterals[c] = multiply ? &ratioTables->multiplyLitterals[ratioIndex] : &ratioTables->divideLitterals[ratioIndex];
+		clockModulators[c].setRatio(multiply ? ratio : 1.f / ratio);
 	}
 
-	int getRatioIndex(float offset) {
-		float value = abs(offset);
-		int size = offset >= 0 ? currentMultiplicators.size() : currentDividers.size();
-		return value > 0 ? std::ceil((value / 10.f) * size) - 1 : 0;
+	// Force each channel to look its ratio up again on next sample
+	void invalidateRatios() {
+		for(int c = 0; c < POLY_CHANNELS; c++) {
+			ratioLows[c] = INFINITY;
+			ratioHighs[c] = -INFINITY;
+		}
 	}
 
 	void updateConnections() {
@@ -548,19 +975,105 @@ struct ClockM8 : M8Module {
 		clockOutputConnected = outputs[CLOCK_OUTPUT].isConnected();
 	}
 
+	bool hasChannelChanges(int newClockChannels) {
+		int newResetChannels = resetInputConnected ? inputs[RESET_INPUT].getChannels() : -1;
+		int newModChannels = modInputConnected ? inputs[MOD_CV_INPUT].getChannels() : -1;
+		int newOutputChannels = countOutputChannels(newClockChannels, newResetChannels, newModChannels);
+		return newClockChannels != clockChannels || newOutputChannels != outputChannels;
+	}
+
+	// Whichever of the inputs or the expander controlled banks has the most
+	// channels defines the number of outputs, as long as a clock is connected
+	int countOutputChannels(int clock, int reset, int mod) {
+		int channels = clock;
+		if(clock > 0 && reset > channels) channels = reset;
+		if(clock > 0 && mod > channels) channels = mod;
+		if(clock > 0 && controlledChannels > channels) channels = controlledChannels;
+		return channels;
+	}
+
+	// A shared channel that ticks without its source, or the other way
+	// around, gets its own follower back, starting from the source's state
+	void checkSharedFollowers(int clockMask) {
+		int shared = sharedFollowersMask;
+		while(shared) {
+			int c = __builtin_ctz(shared);
+			shared &= shared - 1;
+
+			int source = followerSources[c];
+			if(((clockMask >> c) & 1) != ((clockMask >> source) & 1)) {
+				unshareFollower(c);
+			}
+		}
+	}
+
+	void unshareFollower(int c) {
+		clockFollowers[c] = clockFollowers[followerSources[c]];
+		followerSources[c] = c;
+		sharedFollowersMask &= ~(1 << c);
+		linkFollowers();
+	}
+
+	void unshareFollowers() {
+		while(sharedFollowersMask) {
+			unshareFollower(__builtin_ctz(sharedFollowersMask));
+		}
+	}
+
+	// Followers are interchangeable when they'd give the same information to
+	// the modulators : same duration, state and time since their last tick
+	bool followersMatch(ClockFollower* a, ClockFollower* b) {
+		return a->isRunning && b->isRunning
+			&& a->isLearning == b->isLearning
+			&& a->getDuration() == b->getDuration()
+			&& a->m_sampleCounter - a->m_lastClockTick == b->m_sampleCounter - b->m_lastClockTick;
+	}
+
+	void shareFollowers() {
+		bool changed = false;
+		for(int c = 1; c < clockChannels; c++) {
+			if(sharedFollowersMask & (1 << c)) continue;
+			for(int source = 0; source < c; source++) {
+				if(sharedFollowersMask & (1 << source)) continue;
+				if(followersMatch(&clockFollowers[source], &clockFollowers[c])) {
+					followerSources[c] = source;
+					sharedFollowersMask |= 1 << c;
+					changed = true;
+					break;
+				}
+			}
+		}
+		if(changed) linkFollowers();
+	}
+
+	// Point modulators to the follower of their clock channel, without
+	// recomputing their next pulse as the follower's state is the same
+	void linkFollowers() {
+		for(int o = 0; o < outputChannels; o++) {
+			int c = o < clockChannels ? o : clockChannels - 1;
+			clockModulators[o].m_clockFollower = &clockFollowers[followerSources[c]];
+		}
+	}
+
 	void updateChannels() {
 		bool clockInputChanged = false;
 		int newClockChannels = clockInputConnected ? inputs[CLOCK_INPUT].getChannels() : -1;
-		if(newClockChannels != clockChannels) clockInputChanged = true;
+
+		// Channels are about to be relinked, the skipped samples must be applied first
+		if(skippedSamples > 0 && hasChannelChanges(newClockChannels)) catchUp();
+
+		if(newClockChannels != clockChannels) {
+			clockInputChanged = true;
+			unshareFollowers();
+		}
 		clockChannels = newClockChannels;
 
 		int oldNumberOfOutputs = outputChannels;
 		bool outputChanged = false;
 		resetChannels = resetInputConnected ? inputs[RESET_INPUT].getChannels() : -1;
 		modChannels = modInputConnected ? inputs[MOD_CV_INPUT].getChannels() : -1;
-		outputChannels = clockChannels;
-		if(clockChannels > 0 && resetChannels > outputChannels) outputChannels = resetChannels;
-		if(clockChannels > 0 && modChannels > outputChannels) outputChannels = modChannels;
+		outputChannels = countOutputChannels(clockChannels, resetChannels, modChannels);
+		activeChannels = outputChannels > 0 ? outputChannels : 0;
 
 		if(oldNumberOfOutputs != outputChannels) outputChanged = true;
 
@@ -571,10 +1084,12 @@ struct ClockM8 : M8Module {
 			for(int o = 0; o < outputChannels; o++) {
 				// Process resets. 
 				int c = o < clockChannels ? o : clockChannels - 1;
-				clockModulators[o].setClockFollower(&clockFollowers[c]);
+				clockModulators[o].setClockFollower(&clockFollowers[followerSources[c]]);
 			}
 		}
 
+		shareFollowers();
+
 		if(clockOutputConnected) {
 			outputs[CLOCK_OUTPUT].channels = outputChannels > 0 ? outputChannels : 1;
 		}
@@ -609,66 +1124,15 @@ struct ClockM8 : M8Module {
 		if(ratioChanged) updateCurrentRatios();
 	}
 
+	// Just a table swap, every combination is built beforehand
 	void updateCurrentRatios() {
-		currentDividers.clear();
-		currentMultiplicators.clear();
-
-		if(quantizeBinary) {
-			for(int i=0; i<BINARY_VALUES_COUNT; i++) {
-				currentDividers.push_back(binaryValues[i]);
-				currentMultiplicators.push_back(binaryValues[i]);
-			}
-			// Add ODD and ternary dividers ?
-		}
-		if(quantizeTernary) {
-			for(int i=0; i<TERNARY_VALUES_COUNT; i++) {
-				currentDividers.push_back(ternaryValues[i]);
-				currentMultiplicators.push_back(ternaryValues[i]);
-			}
-			// Add odd and binary dividers ?
-		}
-		if(quantizeDotted && quantizeBinary) {
-			for(int i=0; i<DOTTED_BIN_MULT_COUNT; i++) {
-				currentMultiplicators.push_back(dottedBinaryMultiplicators[i]);
-			}
-			for(int i=0; i<DOTTED_BIN_DIV_COUNT; i++) {
-				currentDividers.push_back(dottedBinaryDividers[i]);
-			}
-		}
-		if(quantizeDotted && quantizeTernary) {
-			for(int i=0; i<DOTTED_TER_MULT_COUNT; i++) {
-				currentMultiplicators.push_back(dottedTernaryMultiplicators[i]);
-			}
-			for(int i=0; i<DOTTED_TER_DIV_COUNT; i++) {
-				currentDividers.push_back(dottedTernaryDividers[i]);
-			}
-		}
-		if(quantizeDotted && quantizeOdd) {
-			for(int i=0; i<DOTTED_ODD_MULT_COUNT; i++) {
-				currentMultiplicators.push_back(dottedOddMultiplicators[i]);
-			}
-		}
-
-		if(quantizeOdd) {
-			for(int i=0; i<ODD_VALUES_COUNT; i++) {
-				currentDividers.push_back(oddValues[i]);
-				currentMultiplicators.push_back(oddValues[i]);
-			}
-		}
-
-		// Always have X1 even if no quantization is selected
-		currentDividers.push_back(1.f);
-		currentMultiplicators.push_back(1.f);
-
-		// remove duplicate elements
-    	std::sort(currentDividers.begin(), currentDividers.end());
-    	auto lastDivider = std::unique(currentDividers.begin(), currentDividers.end());
-    	currentDividers.erase(lastDivider, currentDividers.end()); 
-
-
-    	std::sort(currentMultiplicators.begin(), currentMultiplicators.end());
-    	auto lastMultiplicator = std::unique(currentMultiplicators.begin(), currentMultiplicators.end());
-    	currentMultiplicators.erase(lastMultiplicator, currentMultiplicators.end()); 
+		int mask = 0;
+		if(quantizeBinary) mask |= ClockRatioTables::BINARY;
+		if(quantizeTernary) mask |= ClockRatioTables::TERNARY;
+		if(quantizeOdd) mask |= ClockRatioTables::ODD;
+		if(quantizeDotted) mask |= ClockRatioTables::DOTTED;
+		currentRatios = &ratioTables->tables[mask];
+		invalidateRatios();
 	}
 
 	void onSampleRateChange() override {
@@ -687,17 +1151,42 @@ struct ClockM8 : M8Module {
 		}
 	}
 
+	void setTrackingMode(int mode) {
+		trackingMode = mode;
+		for(int i = 0; i < POLY_CHANNELS; i++) {
+			clockFollowers[i].trackingMode = mode;
+			clockFollowers[i].resetTracking();
+		}
+	}
+
+	void setEventDriven(bool enabled) {
+		samplesToNextEvent = 0;
+		eventDriven = enabled;
+	}
+
+	void setPhaseAccurate(bool enabled) {
+		phaseAccurate = enabled;
+		for(int i = 0; i < POLY_CHANNELS; i++) {
+			clockModulators[i].phaseAccurate = enabled;
+		}
+	}
+
 	json_t *dataToJson() override {
 		json_t *rootJ = json_object();
 
 		json_object_set_new(rootJ, "output_mode", json_integer(outputMode));
+		json_object_set_new(rootJ, "phase_accurate", json_boolean(phaseAccurate));
+		json_object_set_new(rootJ, "event_driven", json_boolean(eventDriven));
+		json_object_set_new(rootJ, "tracking_mode", json_integer(trackingMode));
 
 		json_t *followersJ = json_array();
 		json_t *modulatorsJ = json_array();
 
 		for (int i = 0; i < POLY_CHANNELS; i++) {
-			json_array_append_new(followersJ, clockFollowers[i].toJson());
-			json_array_append_new(modulatorsJ, clockModulators[i].toJson());
+			json_array_append_new(followersJ, clockFollowers[followerSources[i]].toJson());
+			json_t* modulatorJ = clockModulators[i].toJson();
+			json_object_set_new(modulatorJ, "ratio_litteral", json_string(channelLitterals[i]->c_str()));
+			json_array_append_new(modulatorsJ, modulatorJ);
 		}
 		
 		json_object_set_new(rootJ, "clock_followers", followersJ);
@@ -709,11 +1198,15 @@ struct ClockM8 : M8Module {
 	void dataFromJson(json_t *rootJ) override {
 
 		setOutputMode(json_integer_value(json_object_get(rootJ, "output_mode")));
+		setPhaseAccurate(json_is_true(json_object_get(rootJ, "phase_accurate")));
+		setEventDriven(json_is_true(json_object_get(rootJ, "event_driven")));
+		setTrackingMode(json_integer_value(json_object_get(rootJ, "tracking_mode")));
 
 		json_t *followersJ = json_object_get(rootJ, "clock_followers");
 		json_t *modulatorsJ = json_object_get(rootJ, "clock_modulators");
 
 		if (followersJ && modulatorsJ) {
+			unshareFollowers();
 			for (int i = 0; i < POLY_CHANNELS; i++) {
 				clockFollowers[i].fromJson(json_array_get(followersJ, i));
 				clockModulators[i].fromJson(json_array_get(modulatorsJ, i));
@@ -755,7 +1248,7 @@ struct ClockModulatorDisplay : TransparentWidget {
 				float ratio = module->clockModulators[0].getRatio();
 			
 				if(ratio != currentRatio) {
-					text = module->clockModulators[0].ratioLitteral;
+					text = *module->channelLitterals[0];
 					label->setText(text);	
 					fb->dirty = true;
 				}
@@ -793,6 +1286,53 @@ struct OutputModeValueItem : MenuItem {
 	}
 };
 
+struct PhaseAccurateItem : MenuItem {
+	ClockM8* module;
+
+	void onAction(const event::Action& e) override {
+		module->setPhaseAccurate(! module->phaseAccurate);
+	}
+};
+
+struct TrackingModeValueItem : MenuItem {
+	int m_mode;
+	ClockM8* module;
+
+	void onAction(const event::Action& e) override {
+		module->setTrackingMode(m_mode);
+	}
+};
+
+struct TrackingModeItem : MenuItem {
+	ClockM8* module;
+
+	Menu* createChildMenu() override {
+		Menu* menu = new Menu;
+
+		const std::string labels[ClockFollower::NUM_TRACKING_MODES] = {
+			"Last interval", "Average (8 ticks)", "Median (5 ticks)", "PLL"
+		};
+		for(int mode = 0; mode < ClockFollower::NUM_TRACKING_MODES; mode++) {
+			TrackingModeValueItem* item = new TrackingModeValueItem;
+			item->m_mode = mode;
+			item->module = module;
+			item->text = labels[mode];
+			item->rightText = CHECKMARK(module->trackingMode == mode);
+			menu->addChild(item);
+		}
+
+		return menu;
+	}
+};
+
+struct EventDrivenItem : MenuItem {
+	ClockM8* module;
+
+	void onAction(const event::Action& e) override {
+		module->setEventDriven(! module->eventDriven);
+	}
+};
+
 struct ClockM8Widget : ModuleWidget {
 	ClockM8Widget(ClockM8* module) {
 		setModule(module);
@@ -850,6 +1390,38 @@ struct ClockM8Widget : ModuleWidget {
 			menu->addChild(menuItem);
 		}
 
+		menu->addChild(new MenuSeparator);
+
+		{
+			TrackingModeItem* menuItem = new TrackingModeItem;
+			menuItem->text = "Clock tracking";
+			menuItem->rightText = RIGHT_ARROW;
+			menuItem->module = module;
+			menu->addChild(menuItem);
+		}
+		{
+			ClockFollower* follower = &module->clockFollowers[0];
+			MenuLabel* label = new MenuLabel;
+			label->text = follower->isRunning ? 
+				string::f("Tempo : %.1f BPM%s", follower->getBpm(), follower->isLocked ? " (locked)" : "")
+				: "Tempo : (stopped)";
+			menu->addChild(label);
+		}
+		{
+			PhaseAccurateItem* menuItem = new PhaseAccurateItem;
+			menuItem->text = "Phase accurate multiplication";
+			menuItem->module = module;
+			menuItem->rightText = CHECKMARK(module->phaseAccurate);
+			menu->addChild(menuItem);
+		}
+		{
+			EventDrivenItem* menuItem = new EventDrivenItem;
+			menuItem->text = "Low CPU (event driven)";
+			menuItem->module = module;
+			menuItem->rightText = CHECKMARK(module->eventDriven);
+			menu->addChild(menuItem);
+		}
+
 	}
 };
 
@@ -13,35 +13,32 @@
 #define M8_DELAY_SYSTEM 4
 
 // utility macros 
-#define isM8ExpanderModule(x) false/*x->model == modelM8X*/
+#define isM8ExpanderModule(x) x->model == modelM8X
 #define isM8SystemModule(x) /*x->model == modelTransM8 ||*/ x->model == modelClockM8 /*|| x->model == modelTimeM8 || x->model == modelDelayM8*/
 //#define isM8Module(x) x->model == modelM8X || x->model == modelTransM8 || x->model == modelClockM8 || x->model == modelTimeM8 || x->model == modelDelayM8
-#define isM8Module(x) /*x->model == modelM8X ||*/ x->model == modelClockM8
+#define isM8Module(x) x->model == modelM8X || x->model == modelClockM8
 
 // Message from the master transport that should be carried
 // all the way from left to right. Let's keep in mind that message
 // mechanism has a 1 sample delay for each module.
 // One solution could be for TransM8 to buffer the transport
 // and do latency compensation at the same time so everything could 
-// be in sync. 
+// be in sync. No module is timed by the bus transport yet, ClockM8
+// runs from its own inputs : compensation stays with TransM8.
 // 
 struct M8TransportMessage {
+	// Changes whenever the transport does, the message is only copied
+	// along the chain when it differs from the one already in place
+	uint32_t sequence = 0;
+
 	float phases[M8_POLY_CHANNELS];
 	bool running = false;
 	bool start = false;
 	bool stop = false;
 	bool reset = false;
 
-	M8TransportMessage() {}
-
-	M8TransportMessage(const M8TransportMessage &other) {
-		running = other.running;
-		start = other.start;
-		stop = other.stop;
-		reset = other.reset;
-		for(int x = 0; x < M8_POLY_CHANNELS; x++) {
-			phases[x] = other.phases[x];
-		}
+	M8TransportMessage() {
+		std::fill(phases, phases + M8_POLY_CHANNELS, 0.f);
 	}
 };
 
@@ -61,33 +58,25 @@ struct M8StatusMessage {
 	// Number of active channels
 	int activeChannels = 0;
 
-	// Channel litterals
-	std::string* litterals[M8_POLY_CHANNELS];
+	// Channel litterals, pointing into strings the system module never
+	// frees. Copied along the chain only when the version changes.
+	const std::string* litterals[M8_POLY_CHANNELS];
+	uint32_t litteralsVersion = 0;
 
 	// Would be used when an expander is connected to an M8 module, so the
 	// parameter values can be set to reflect current state. 
 	float values[M8_POLY_CHANNELS];
+	uint32_t valuesSequence = 0;
 
 	// Channel output raw value
 	float outputs[M8_POLY_CHANNELS];
+	uint32_t outputsSequence = 0;
 
 	M8StatusMessage() {
-		for(int x = 0; x < M8_POLY_CHANNELS; x++) {
-			values[x] = 0.f;
-			outputs[x] = 0.f;
-		}
+		std::fill(litterals, litterals + M8_POLY_CHANNELS, (const std::string*) NULL);
+		std::fill(values, values + M8_POLY_CHANNELS, 0.f);
+		std::fill(outputs, outputs + M8_POLY_CHANNELS, 0.f);
 	}
-
-	M8StatusMessage(const M8StatusMessage &other) {
-		moduleType = other.moduleType;
-		expanderCount = other.expanderCount;
-		activeChannels = other.activeChannels;
-		for(int x = 0; x < M8_POLY_CHANNELS; x++) {
-			values[x] = other.values[x];
-			outputs[x] = other.outputs[x];
-		}
-	}
-
 };
 
 // Control message structure that will be passed right to left until a M8 Module is reached
@@ -97,25 +86,17 @@ struct M8ControlMessage {
 	bool bankA = false;	// Set to true if 1-8 bank is controlled
 	bool bankB = false; // Set to true if 9-16 bank is controlled
 
+	// Sequence of the controller values and connections below
+	uint32_t sequence = 0;
+
 	float controllerValues[M8_POLY_CHANNELS];
 
 	// Can serve at determining the number of needed channels
 	bool outputConnected[M8_POLY_CHANNELS];
 
 	M8ControlMessage() {
-		for(int x = 0; x < M8_POLY_CHANNELS; x++) {
-			controllerValues[x] = 0.f;
-			outputConnected[x] = false;
-		}
-	}
-
-	M8ControlMessage(const M8ControlMessage &other) {
-		bankA = other.bankA;
-		bankB = other.bankB;
-		for(int x = 0; x < M8_POLY_CHANNELS; x++) {
-			controllerValues[x] = other.controllerValues[x];
-			outputConnected[x] = other.outputConnected[x];
- 		}
+		std::fill(controllerValues, controllerValues + M8_POLY_CHANNELS, 0.f);
+		std::fill(outputConnected, outputConnected + M8_POLY_CHANNELS, false);
 	}
 };
 
@@ -137,29 +118,80 @@ struct M8Module : Module {
 	int rightExpanderType = M8_NO_MODULE;
 
 	int activeChannels = 0;
-	std::string* channelLitterals[M8_POLY_CHANNELS];
+	const std::string* channelLitterals[M8_POLY_CHANNELS];
 	float channelOutputs[M8_POLY_CHANNELS];
 	float channelControls[M8_POLY_CHANNELS];
 
+	// Litterals table last published, and the sequence of the outputs
+	// as they are now. Both change only when the module marks them so.
+	const std::string* publishedLitterals[M8_POLY_CHANNELS];
+	uint32_t litteralsVersion = 0;
+	uint32_t outputsSequence = 0;
+	uint32_t controlsSequence = 0;
+
+	// Set by expanders to the control message they built from the one
+	// received and their own controls, forwarded as is otherwise
+	const M8ControlMessage* outgoingControl = NULL;
+
 	M8Message leftMessages[2][1];
 	M8Message rightMessages[2][1];
 
-	M8TransportMessage* transportMessage;
-	M8StatusMessage* statusMessage;
-	M8ControlMessage* controlMessage;
+	// Point into the consumer buffers, the engine swaps them on every flip
+	const M8TransportMessage* transportMessage;
+	const M8StatusMessage* statusMessage;
+	const M8ControlMessage* controlMessage;
 
 	M8Module() {
+		std::fill(publishedLitterals, publishedLitterals + M8_POLY_CHANNELS, (const std::string*) NULL);
+
 		leftExpander.consumerMessage = leftMessages[0];
 		leftExpander.producerMessage = leftMessages[1];
 		rightExpander.consumerMessage = rightMessages[0];
 		rightExpander.producerMessage = rightMessages[1];
 
-		transportMessage = &leftMessages[0]->transport;
-		statusMessage = &leftMessages[0]->status;
-		controlMessage = &rightMessages[0]->control;
+		updateMessagePointers();
+	}
+
+	// Sequences are unique across modules, so a buffer that last received
+	// data from another module is never mistaken as up to date
+	static uint32_t nextSequence() {
+		static std::atomic<uint32_t> sequence(0);
+		return ++sequence;
+	}
+
+	// Stands for a missing neighbour
+	static const M8Message& getEmptyMessage() {
+		static const M8Message empty;
+		return empty;
+	}
+
+	void updateMessagePointers() {
+		const M8Message* left = (const M8Message*) leftExpander.consumerMessage;
+		const M8Message* right = (const M8Message*) rightExpander.consumerMessage;
+		transportMessage = &left->transport;
+		statusMessage = &left->status;
+		controlMessage = &right->control;
+	}
+
+	void markOutputsChanged() {
+		outputsSequence = nextSequence();
+	}
+
+	void markControlsChanged() {
+		controlsSequence = nextSequence();
+	}
+
+	// Runs on the audio thread, a new version is only sent along the
+	// chain if the litterals changed
+	void publishLitterals() {
+		if(litteralsVersion && std::equal(channelLitterals, channelLitterals + M8_POLY_CHANNELS, publishedLitterals)) return;
+		std::copy(channelLitterals, channelLitterals + M8_POLY_CHANNELS, publishedLitterals);
+		litteralsVersion = nextSequence();
 	}
 
 	void updateExpanders() {
+		updateMessagePointers();
+
 		leftLinkActive = leftExpander.module ? isM8Module(leftExpander.module) ? true : false : false;
 		rightLinkActive = rightExpander.module ? isM8Module(rightExpander.module) ? true : false : false;
 
@@ -167,21 +199,63 @@ struct M8Module : Module {
 		rightExpanderType = rightLinkActive ? reinterpret_cast<M8Module*>(rightExpander.module)->moduleType : M8_NO_MODULE;
 	}
 
+	void sendMessages() {
+		if(rightLinkActive) sendStatusMessage();
+		if(leftLinkActive) sendControlMessage();
+	}
+
+	// Only the header is written on every sample, other sections are copied
+	// when the producer buffer holds an older sequence than the one sent
 	void sendStatusMessage() {
 		M8Message *message = (M8Message*)(rightExpander.module->leftExpander.producerMessage);
-		message->status = *statusMessage;
-		message->transport = *transportMessage;
+		const M8Message& received = leftLinkActive ? *(const M8Message*) leftExpander.consumerMessage : getEmptyMessage();
+		M8StatusMessage& status = message->status;
+
+		if(message->transport.sequence != received.transport.sequence) {
+			message->transport = received.transport;
+		}
+
+		status.moduleType = received.status.moduleType;
+		status.expanderCount = received.status.expanderCount;
+		status.activeChannels = received.status.activeChannels;
 
 		if(isM8SystemModule(this)) {
-			message->status.moduleType = moduleType;
+			// Expanders on the right count from this module
+			status.moduleType = moduleType;
+			status.expanderCount = 0;
+			status.activeChannels = activeChannels;
+
+			// Current controls are echoed back for the expanders to display
+			if(status.valuesSequence != controlsSequence) {
+				std::copy(channelControls, channelControls + M8_POLY_CHANNELS, status.values);
+				status.valuesSequence = controlsSequence;
+			}
 
-			for(int x = 0; x < M8_POLY_CHANNELS; x++) {
-				message->status.litterals[x] = channelLitterals[x];
-				message->status.outputs[x] = channelOutputs[x];
+			if(status.litteralsVersion != litteralsVersion) {
+				std::copy(publishedLitterals, publishedLitterals + M8_POLY_CHANNELS, status.litterals);
+				status.litteralsVersion = litteralsVersion;
+			}
+			if(status.outputsSequence != outputsSequence) {
+				std::copy(channelOutputs, channelOutputs + M8_POLY_CHANNELS, status.outputs);
+				status.outputsSequence = outputsSequence;
 			}
 		}
 		else {
-			message->status.expanderCount++;
+			status.expanderCount++;
+
+			if(status.valuesSequence != received.status.valuesSequence) {
+				std::copy(received.status.values, received.status.values + M8_POLY_CHANNELS, status.values);
+				status.valuesSequence = received.status.valuesSequence;
+			}
+
+			if(status.litteralsVersion != received.status.litteralsVersion) {
+				std::copy(received.status.litterals, received.status.litterals + M8_POLY_CHANNELS, status.litterals);
+				status.litteralsVersion = received.status.litteralsVersion;
+			}
+			if(status.outputsSequence != received.status.outputsSequence) {
+				std::copy(received.status.outputs, received.status.outputs + M8_POLY_CHANNELS, status.outputs);
+				status.outputsSequence = received.status.outputsSequence;
+			}
 		}
 
 		rightExpander.module->leftExpander.messageFlipRequested = true;
@@ -189,7 +263,20 @@ struct M8Module : Module {
 
 	void sendControlMessage() {
 		M8Message *message = (M8Message*)(leftExpander.module->rightExpander.producerMessage);	
-		message->control = *controlMessage;	
+		const M8ControlMessage* source = outgoingControl ? outgoingControl : rightLinkActive ? controlMessage : &getEmptyMessage().control;
+		// Expander controls stop at the first system module
+		if(isM8SystemModule(this)) source = &getEmptyMessage().control;
+		const M8ControlMessage& received = *source;
+		M8ControlMessage& control = message->control;
+
+		control.bankA = received.bankA;
+		control.bankB = received.bankB;
+
+		if(control.sequence != received.sequence) {
+			std::copy(received.controllerValues, received.controllerValues + M8_POLY_CHANNELS, control.controllerValues);
+			std::copy(received.outputConnected, received.outputConnected + M8_POLY_CHANNELS, control.outputConnected);
+			control.sequence = received.sequence;
+		}
 
 		leftExpander.module->rightExpander.messageFlipRequested = true;	
 	}
@@ -0,0 +1,226 @@
+#include "23volts.hpp"
+#include "widgets/knobs.hpp"
+#include "widgets/labels.hpp"
+#include "M8.hpp"
+
+// Expander for M8 system modules. The first M8X on the right of a system
+// module controls channels 1-8, the second one channels 9-16.
+struct M8X : M8Module {
+
+	static const int BANK_SIZE = 8;
+	static const int BANKS = M8_POLY_CHANNELS / BANK_SIZE;
+
+	enum ParamIds {
+		ENUMS(RATIO_KNOBS, BANK_SIZE),
+		NUM_PARAMS
+	};
+	enum InputIds {
+		NUM_INPUTS
+	};
+	enum OutputIds {
+		NUM_OUTPUTS
+	};
+	enum LightIds {
+		ENUMS(OUTPUT_LIGHTS, BANK_SIZE),
+		NUM_LIGHTS
+	};
+
+	dsp::ClockDivider lightDivider;
+
+	// Bank this expander controls, -1 while no system module is on its left
+	int bank = -1;
+
+	float knobValues[BANK_SIZE];
+	bool controlsDirty = true;
+
+	// Controls received from the right merged with the knobs of this expander
+	M8ControlMessage localControl;
+	uint32_t receivedControlSequence = 0;
+
+	// Last sections of the status message copied to the module state
+	uint32_t receivedLitteralsVersion = 0;
+	uint32_t receivedValuesSequence = 0;
+	uint32_t receivedOutputsSequence = 0;
+
+	M8X() {
+		moduleType = M8_EXPANDER;
+
+		config(NUM_PARAMS, NUM_INPUTS, NUM_OUTPUTS, NUM_LIGHTS);
+		for(int x = 0; x < BANK_SIZE; x++) {
+			configParam(RATIO_KNOBS + x, -10.0, 10.0, 0.0, string::f("Divide/Multiply %d", x + 1));
+			knobValues[x] = 0.f;
+		}
+
+		for(int x = 0; x < M8_POLY_CHANNELS; x++) {
+			channelLitterals[x] = NULL;
+			channelOutputs[x] = 0.f;
+			channelControls[x] = 0.f;
+		}
+
+		lightDivider.setDivision(16);
+		outgoingControl = &localControl;
+	}
+
+	void process(const ProcessArgs& args) override {
+		updateExpanders();
+		updateBank();
+		updateControls();
+		receiveStatus();
+
+		if(lightDivider.process()) updateLights(args.sampleTime * lightDivider.getDivision());
+
+		sendMessages();
+	}
+
+	void updateBank() {
+		const M8StatusMessage& status = leftLinkActive ? *statusMessage : getEmptyMessage().status;
+		bool attached = status.moduleType != M8_NO_MODULE && status.moduleType != M8_EXPANDER;
+		int newBank = attached && status.expanderCount < BANKS ? status.expanderCount : -1;
+
+		if(newBank != bank) {
+			bank = newBank;
+			controlsDirty = true;
+		}
+	}
+
+	void updateControls() {
+		const M8ControlMessage& received = rightLinkActive ? *controlMessage : getEmptyMessage().control;
+
+		for(int x = 0; x < BANK_SIZE; x++) {
+			float value = params[RATIO_KNOBS + x].getValue();
+			if(value != knobValues[x]) {
+				knobValues[x] = value;
+				controlsDirty = true;
+			}
+		}
+		if(received.sequence != receivedControlSequence) {
+			receivedControlSequence = received.sequence;
+			controlsDirty = true;
+		}
+
+		localControl.bankA = received.bankA || bank == 0;
+		localControl.bankB = received.bankB || bank == 1;
+
+		if(controlsDirty) {
+			std::copy(received.controllerValues, received.controllerValues + M8_POLY_CHANNELS, localControl.controllerValues);
+			std::copy(received.outputConnected, received.outputConnected + M8_POLY_CHANNELS, localControl.outputConnected);
+			if(bank >= 0) {
+				std::copy(knobValues, knobValues + BANK_SIZE, localControl.controllerValues + bank * BANK_SIZE);
+			}
+			localControl.sequence = nextSequence();
+			controlsDirty = false;
+		}
+	}
+
+	// Keeps a copy of the system module state, the display must not read
+	// the message buffers the engine flips
+	void receiveStatus() {
+		const M8StatusMessage& status = bank >= 0 ? *statusMessage : getEmptyMessage().status;
+
+		activeChannels = status.activeChannels;
+
+		if(status.litteralsVersion != receivedLitteralsVersion) {
+			receivedLitteralsVersion = status.litteralsVersion;
+			std::copy(status.litterals, status.litterals + M8_POLY_CHANNELS, channelLitterals);
+		}
+		if(status.valuesSequence != receivedValuesSequence) {
+			receivedValuesSequence = status.valuesSequence;
+			std::copy(status.values, status.values + M8_POLY_CHANNELS, channelControls);
+		}
+		if(status.outputsSequence != receivedOutputsSequence) {
+			receivedOutputsSequence = status.outputsSequence;
+			std::copy(status.outputs, status.outputs + M8_POLY_CHANNELS, channelOutputs);
+		}
+	}
+
+	void updateLights(float deltaTime) {
+		for(int x = 0; x < BANK_SIZE; x++) {
+			int c = bank * BANK_SIZE + x;
+			float brightness = bank >= 0 && c < activeChannels ? channelOutputs[c] / 10.f : 0.f;
+			lights[OUTPUT_LIGHTS + x].setSmoothBrightness(brightness, deltaTime);
+		}
+	}
+
+	// True when the system module applied the value of this channel knob
+	bool isApplied(int x) {
+		int b = bank;
+		return b >= 0 && channelControls[b * BANK_SIZE + x] == knobValues[x];
+	}
+};
+
+struct M8XChannelDisplay : TransparentWidget {
+	M8X* module;
+	int index = 0;
+	FramebufferWidget* fb;
+	TextLabel* label;
+
+	const std::string* currentLitteral = NULL;
+	bool currentApplied = false;
+
+	M8XChannelDisplay(Vec size) {
+		this->box.size = size;
+		fb = new FramebufferWidget();
+		fb->box.size = size;
+		addChild(fb);
+		auto fontFileName = "res/fonts/EHSMB.TTF";
+		std::shared_ptr<Font> font = APP->window->loadFont(asset::plugin(pluginInstance, fontFileName));
+		label = new TextLabel(font);
+		label->box.pos = Vec(-1.f, 2.f);
+		label->box.size = size;
+		label->setFontSize(10.f);
+		std::string text = std::string("----");
+		label->setText(text);
+		label->setColor(SCHEME_ORANGE_23V);
+		fb->addChild(label);
+		fb->dirty = true;
+	}
+
+	void step() override {
+		if (module) {
+			int bank = module->bank;
+			int c = bank * M8X::BANK_SIZE + index;
+			const std::string* litteral = bank >= 0 && c < module->activeChannels ? module->channelLitterals[c] : NULL;
+			bool applied = module->isApplied(index);
+
+			if(litteral != currentLitteral || applied != currentApplied) {
+				std::string text = litteral ? *litteral : "----";
+				label->setText(text);
+				// Dimmed until the system module follows the knob
+				label->setColor(applied ? SCHEME_ORANGE_23V : nvgRGB(0x7a, 0x7a, 0x7a));
+				fb->dirty = true;
+				currentLitteral = litteral;
+				currentApplied = applied;
+			}
+		}
+
+		TransparentWidget::step();
+	}
+};
+
+struct M8XWidget : ModuleWidget {
+	M8XWidget(M8X* module) {
+		setModule(module);
+		setPanel(APP->window->loadSvg(asset::plugin(pluginInstance, "res/M8X.svg")));
+
+		for(int x = 0; x < M8X::BANK_SIZE; x++) {
+			float y = 42.f + x * 38.f;
+
+			addParam(createParam<KnobDark26>(Vec(6.f, y), module, M8X::RATIO_KNOBS + x));
+
+			M8XChannelDisplay *display = new M8XChannelDisplay(Vec(33.f, 14.f));
+			display->module = module;
+			display->index = x;
+			display->box.pos = Vec(36.f, y + 2.f);
+			addChild(display);
+
+			addChild(createLight<TinyLight<YellowLight>>(Vec(51.f, y + 20.f), module, M8X::OUTPUT_LIGHTS + x));
+		}
+
+		addChild(createWidget<ScrewSilver>(Vec(RACK_GRID_WIDTH, 0)));
+		addChild(createWidget<ScrewSilver>(Vec(box.size.x - 2 * RACK_GRID_WIDTH, 0)));
+		addChild(createWidget<ScrewSilver>(Vec(RACK_GRID_WIDTH, RACK_GRID_HEIGHT - RACK_GRID_WIDTH)));
+		addChild(createWidget<ScrewSilver>(Vec(box.size.x - 2 * RACK_GRID_WIDTH, RACK_GRID_HEIGHT - RACK_GRID_WIDTH)));
+	}
+};
+
+Model* modelM8X = createModel<M8X, M8XWidget>("M8X");
@@ -1,100 +1,875 @@
+#include <cctype>
+#include <chrono>
+#include <cstdio>
+#include <map>
+#include <mutex>
+#include <random>
+#include <thread>
 #include "23volts.hpp"
+#include "helpers.hpp"
 #include "widgets/ports.hpp"
 
-struct MemoryBank {
+using simd::float_4;
+
+// What Mem reads and writes, whether the memory lives in RAM or in a file.
+// Only the first HEAD_SIZE values of each lane are sure to be in RAM.
+struct MemoryStorage {
+	static const int HEAD_SIZE = 16384;
+
+	virtual ~MemoryStorage() {}
+	virtual int lanes() const = 0;
+	virtual int size(int lane) const = 0;
+	virtual float getValue(int position, int lane) = 0;
+	/**
+	 * Append a value, returns false if the memory is full
+	 */
+	virtual bool push(float value, int lane) = 0;
+	virtual void clear(int lane) = 0;
+	virtual void truncate(int size) = 0;
+	// First values of a lane, up to HEAD_SIZE of them
+	virtual const float* head(int lane) const = 0;
+	// Takes over the first values of each lane of source
+	virtual void fill(const MemoryStorage& source) = 0;
+};
+
+// Fixed capacity memory, allocated once. Nothing in here allocates or
+// frees, so it can be written and cleared from the audio thread.
+// Polyphonic memories share one allocation, each lane being a contiguous
+// block of the buffer.
+struct MemoryBank : MemoryStorage {
 	private:
 		int m_max_size;
+		int m_lanes;
+		int m_stride;
+		int m_sizes[16];
+		float* m_buffer;
 		float* m_data;
 
-		void initData() {
-			m_memory = new std::vector<float>;
-			m_memory->reserve(m_max_size);
-			m_data = m_memory->data();
-		}
-
 	public:
-		std::vector<float>* m_memory;
-		
-		MemoryBank(int maxSize) 
+		MemoryBank(int maxSize, int lanes = 1) 
 		{
-			m_max_size = maxSize;
-			initData();
+			m_max_size = std::min(maxSize, (int) HEAD_SIZE);
+			m_lanes = clamp(lanes, 1, 16);
+			// Lanes start on a multiple of 4 floats so they all stay aligned
+			m_stride = (m_max_size + 3) & ~3;
+			// Over allocate so data can be aligned on 16 bytes for SIMD loads
+			m_buffer = new float[m_stride * m_lanes + 4];
+			m_data = reinterpret_cast<float*>((reinterpret_cast<uintptr_t>(m_buffer) + 15) & ~(uintptr_t) 15);
+			clear();
 		}
 		~MemoryBank() 
 		{
-			delete m_memory;
+			delete[] m_buffer;
 		}
 
-		float* data() const 
+		float* data(int lane = 0) const 
 		{
-			return m_data;
+			return m_data + lane * m_stride;
 		}
 
-		int size() const
+		int size(int lane = 0) const override
 		{
-			return m_memory->size();
+			return m_sizes[lane];
 		}
 
-		float getValue(int position) const
+		int capacity() const
 		{
-			return m_data[position];
+			return m_max_size;
+		}
+
+		int lanes() const override
+		{
+			return m_lanes;
+		}
+
+		float getValue(int position, int lane = 0) override
+		{
+			return m_data[lane * m_stride + position];
+		}
+
+		bool push(float value, int lane = 0) override
+		{
+			if(m_sizes[lane] >= m_max_size) return false;
+			m_data[lane * m_stride + m_sizes[lane]++] = value;
+			return true;
 		}
 
 		void clear() 
 		{
-			delete m_memory;
-			initData();
+			std::fill(m_sizes, m_sizes + 16, 0);
+		}
+
+		void clear(int lane) override
+		{
+			m_sizes[lane] = 0;
+		}
+
+		void truncate(int size) override
+		{
+			for(int lane = 0; lane < m_lanes; lane++) {
+				m_sizes[lane] = std::min(m_sizes[lane], size);
+			}
+		}
+
+		const float* head(int lane) const override
+		{
+			return data(lane);
 		}
 
 		/**
-		 * Fill the internal data with data from another vector. 
-		 * Source if truncated if the size of source vector > m_max_size
+		 * Fill the internal data with values. 
+		 * Source is truncated if count > m_max_size
 		 */
-		void fill(std::vector<float>* sourceVector)
+		void fill(const float* values, int count, int lane = 0)
+		{
+			m_sizes[lane] = std::min(count, m_max_size);
+			std::copy(values, values + m_sizes[lane], data(lane));
+		}
+
+		void fill(const MemoryStorage& source) override
+		{
+			for(int lane = 0; lane < m_lanes && lane < source.lanes(); lane++) {
+				fill(source.head(lane), std::min(source.size(lane), (int) HEAD_SIZE), lane);
+			}
+		}
+
+};
+
+// Files of the streamed memories. Rack v1 has no folder per patch, they
+// all live in <user>/23volts/Mem. A file loaded or saved with a patch is
+// never written to again : the memory moves to a new file on its next
+// write, so saved patches, autosaves and duplicates keep their content.
+// references.json lists the patches each file was saved in. Files never
+// saved are deleted when closed. The first time a memory is streamed in a
+// session, saved files that no module has open and that no patch mentions
+// anymore are moved to the trash folder, never deleted : a patch may have
+// been renamed or copied elsewhere.
+struct MemoryStreamFiles {
+	std::mutex mutex;
+	// Number of memories streaming from each file
+	std::map<std::string, int> openFiles;
+	// Patch paths each file was saved with, empty for an untitled patch.
+	// Files created in this session start with no path.
+	std::map<std::string, std::vector<std::string>> references;
+	bool referencesLoaded = false;
+	bool collected = false;
+	// Names are drawn from the worker thread too, which has no Rack random state
+	std::mt19937 nameGenerator;
+
+	MemoryStreamFiles() {
+		nameGenerator.seed(std::random_device()() ^ (uint32_t) std::chrono::steady_clock::now().time_since_epoch().count());
+	}
+
+	/**
+	 * Only names made by create() are ever opened or removed, a patch can't
+	 * point anywhere else
+	 */
+	static bool isStreamFile(const std::string& fileName) {
+		if(fileName.size() != 20 || fileName.compare(16, 4, ".mem") != 0) return false;
+		for(int i = 0; i < 16; i++) {
+			if(! std::isxdigit((unsigned char) fileName[i])) return false;
+		}
+		return true;
+	}
+
+	static std::string getPath(const std::string& fileName) {
+		std::string directory = asset::user("23volts");
+		system::createDirectory(directory);
+		directory += "/Mem";
+		system::createDirectory(directory);
+		return directory + "/" + fileName;
+	}
+
+	/**
+	 * Returns the name of a new file, counted as open. It is deleted when
+	 * closed unless a patch was saved with it.
+	 */
+	std::string create() {
+		std::lock_guard<std::mutex> lock(mutex);
+		loadReferences();
+		std::string fileName;
+		do {
+			fileName = string::f("%08x%08x.mem", (uint32_t) nameGenerator(), (uint32_t) nameGenerator());
+		} while(references.count(fileName) || system::isFile(getPath(fileName)));
+		references[fileName];
+		openFiles[fileName]++;
+		return fileName;
+	}
+
+	void open(const std::string& fileName) {
+		std::lock_guard<std::mutex> lock(mutex);
+		openFiles[fileName]++;
+	}
+
+	void close(const std::string& fileName) {
+		std::lock_guard<std::mutex> lock(mutex);
+		if(--openFiles[fileName] > 0) return;
+		openFiles.erase(fileName);
+
+		auto entry = references.find(fileName);
+		if(entry != references.end() && entry->second.empty()) {
+			std::remove(getPath(fileName).c_str());
+			references.erase(entry);
+		}
+	}
+
+	/**
+	 * Called from the UI thread when a patch is saved with the file
+	 */
+	void addReference(const std::string& fileName, const std::string& patchPath) {
+		std::lock_guard<std::mutex> lock(mutex);
+		loadReferences();
+		std::vector<std::string>& paths = references[fileName];
+		if(std::find(paths.begin(), paths.end(), patchPath) != paths.end()) return;
+		paths.push_back(patchPath);
+		saveReferences();
+	}
+
+	/**
+	 * Called from the worker thread, only does something once per session.
+	 * A patch that can't be found may have been moved, its files are kept.
+	 * Files trashed can be put back in the Mem folder by hand.
+	 */
+	void collect() {
+		std::map<std::string, std::vector<std::string>> saved;
 		{
-			float* data = sourceVector->data();
-			for (int x=0; x < (int) sourceVector->size() && x < m_max_size; x++) {
-				m_memory->push_back(data[x]);
+			std::lock_guard<std::mutex> lock(mutex);
+			if(collected) return;
+			collected = true;
+			loadReferences();
+			saved = references;
+		}
+
+		// Whichever patch the autosave or the template come from, they may mention any file
+		std::map<std::string, std::string> patches;
+		std::vector<std::string> fixedPatches = {asset::user("autosave.vcv"), asset::user("template.vcv")};
+		std::vector<std::string> unused;
+
+		for(auto& entry : saved) {
+			const std::string& fileName = entry.first;
+			std::vector<std::string> patchPaths = fixedPatches;
+			bool used = false;
+			for(const std::string& patchPath : entry.second) {
+				if(patchPath.empty()) continue;
+				if(! system::isFile(patchPath)) used = true;
+				patchPaths.push_back(patchPath);
+			}
+			for(const std::string& patchPath : patchPaths) {
+				if(used) break;
+				if(! patches.count(patchPath)) patches[patchPath] = readFile(patchPath);
+				used = patches[patchPath].find(fileName) != std::string::npos;
+			}
+			if(! used) unused.push_back(fileName);
+		}
+		if(unused.empty()) return;
+
+		std::string trash = getPath("trash");
+		system::createDirectory(trash);
+
+		std::lock_guard<std::mutex> lock(mutex);
+		for(const std::string& fileName : unused) {
+			if(openFiles.count(fileName)) continue;
+			std::rename(getPath(fileName).c_str(), (trash + "/" + fileName).c_str());
+			references.erase(fileName);
+		}
+		saveReferences();
+	}
+
+	private:
+		void loadReferences() {
+			if(referencesLoaded) return;
+			referencesLoaded = true;
+
+			json_t* rootJ = json_load_file(getPath("references.json").c_str(), 0, NULL);
+			if(! rootJ) return;
+			const char* fileName;
+			json_t* pathsJ;
+			json_object_foreach(rootJ, fileName, pathsJ) {
+				if(! isStreamFile(fileName)) continue;
+				std::vector<std::string>& paths = references[fileName];
+				size_t index;
+				json_t* pathJ;
+				json_array_foreach(pathsJ, index, pathJ) {
+					if(json_is_string(pathJ)) paths.push_back(json_string_value(pathJ));
+				}
 			}
+			json_decref(rootJ);
 		}
 
+		void saveReferences() {
+			json_t* rootJ = json_object();
+			for(auto& entry : references) {
+				// Files never saved are deleted on close
+				if(entry.second.empty()) continue;
+				json_t* pathsJ = json_array();
+				for(const std::string& path : entry.second) {
+					json_array_append_new(pathsJ, json_string(path.c_str()));
+				}
+				json_object_set_new(rootJ, entry.first.c_str(), pathsJ);
+			}
+			json_dump_file(rootJ, getPath("references.json").c_str(), JSON_INDENT(2));
+			json_decref(rootJ);
+		}
+
+		static std::string readFile(const std::string& path) {
+			std::string content;
+			FILE* file = fopen(path.c_str(), "rb");
+			if(! file) return content;
+			char buffer[1 << 16];
+			size_t count;
+			while((count = fread(buffer, 1, sizeof(buffer), file)) > 0) {
+				content.append(buffer, count);
+			}
+			fclose(file);
+			return content;
+		}
 };
 
+static MemoryStreamFiles memoryStreamFiles;
+
+// Monophonic memory kept in a file, for sizes that would weigh too much in
+// RAM and in the patch. The file is read and written by chunks of
+// HEAD_SIZE values : the first chunk always stays in RAM, the worker thread
+// loads the chunk being played and the next one ahead of time, and writes
+// modified chunks back.
+// The audio thread never waits for the file. Reading a chunk that isn't
+// loaded yet holds the last value, writing to it drops the value.
+// A chunk is marked dirty after its values and the size are stored, so the
+// worker saving it either sees the last values or gets it marked again.
+// Once the file is shared with a saved patch, the first modified chunk
+// starts a new file. Chunks not copied yet are read from the shared one,
+// the worker copies them in the background, one per pass.
+struct StreamedMemoryBank : MemoryStorage {
+	static const int CHUNK_SIZE = HEAD_SIZE;
+	static const int CHUNKS = 256;
+	static const int MAX_SIZE = CHUNK_SIZE * CHUNKS;
+	// Slot 0 holds the first chunk, the others the chunk being played, the
+	// next one and one being written back
+	static const int SLOTS = 4;
+	// Modified chunks still in use are saved that often, in seconds
+	static constexpr float SAVE_INTERVAL = 1.f;
+
+	enum SlotStates {
+		// Free for the audio thread to request a chunk
+		SLOT_FREE,
+		// Waiting for the worker to read its chunk
+		SLOT_LOADING,
+		// Owned by the audio thread
+		SLOT_READY,
+		// Waiting for the worker to write its chunk back, if modified
+		SLOT_RELEASING
+	};
+
+	struct Slot {
+		float* data;
+		int chunk;
+		std::atomic<int> state;
+		std::atomic<bool> dirty;
+	};
+
+	private:
+		// Only changed by the worker thread, or under its lock
+		std::string m_fileName;
+		FILE* m_file;
+		// Set while the file belongs to a saved patch, the next chunk
+		// written moves the memory to a new file
+		bool m_shared;
+		// File the memory moved from, until all its chunks are copied
+		std::string m_sourceName;
+		FILE* m_source = NULL;
+		int m_sourceChunks = 0;
+		bool m_copied[CHUNKS];
+		float* m_copyBuffer;
+		Slot m_slots[SLOTS];
+		std::atomic<int> m_size;
+		int m_currentChunk = -1;
+		float m_lastValue = 0.f;
+		float m_saveTimer = 0.f;
+
+	public:
+		/**
+		 * Streams from the given file, read only until the memory is
+		 * modified, or from a new file if fileName is empty or wasn't made
+		 * by MemoryStreamFiles. The first size
+		 * values are meaningful. Called from the UI thread.
+		 */
+		StreamedMemoryBank(const std::string& fileName, int size);
+		~StreamedMemoryBank();
+
+		/**
+		 * Called from the UI thread when the patch is saved or the module
+		 * duplicated : writes every modified chunk and returns the name of
+		 * the file holding them. The file then belongs to what was saved.
+		 * Chunks the worker didn't copy yet are copied here.
+		 */
+		std::string save();
+
+		int lanes() const override
+		{
+			return 1;
+		}
+
+		int size(int lane) const override
+		{
+			return m_size.load(std::memory_order_relaxed);
+		}
+
+		float getValue(int position, int lane) override
+		{
+			Slot* slot = access(position);
+			if(slot) m_lastValue = slot->data[position % CHUNK_SIZE];
+			return m_lastValue;
+		}
+
+		bool push(float value, int lane) override
+		{
+			int position = m_size.load(std::memory_order_relaxed);
+			if(position >= MAX_SIZE) return false;
+			Slot* slot = access(position);
+			// Positions keep following the triggers, even if the value is lost
+			m_size.store(position + 1, std::memory_order_relaxed);
+			if(slot) {
+				slot->data[position % CHUNK_SIZE] = value;
+				slot->dirty.store(true, std::memory_order_release);
+			}
+			return true;
+		}
+
+		void clear(int lane) override
+		{
+			m_size = 0;
+		}
+
+		void truncate(int size) override
+		{
+			if(size < m_size) m_size = size;
+		}
+
+		const float* head(int lane) const override
+		{
+			return m_slots[0].data;
+		}
+
+		void fill(const MemoryStorage& source) override
+		{
+			int count = std::min(source.size(0), (int) CHUNK_SIZE);
+			std::copy(source.head(0), source.head(0) + count, m_slots[0].data);
+			m_size = count;
+			m_slots[0].dirty.store(true, std::memory_order_release);
+		}
+
+		/**
+		 * Called from the worker thread, reads requested chunks and writes
+		 * modified ones back
+		 */
+		void service(float elapsed)
+		{
+			m_saveTimer += elapsed;
+			bool saveDue = m_saveTimer >= SAVE_INTERVAL;
+			if(saveDue) m_saveTimer = 0.f;
+
+			for(Slot& slot : m_slots) {
+				int state = slot.state.load(std::memory_order_acquire);
+				// The new file is started right away, so its copy is
+				// likely done before the next save
+				if(m_shared && slot.dirty.load(std::memory_order_acquire)) detach();
+				if(state == SLOT_LOADING) {
+					// The chunk may have been released just before, it has to
+					// be written before it's read again
+					releaseSlots();
+					readChunk(slot);
+					slot.state.store(SLOT_READY, std::memory_order_release);
+				}
+				else if(state == SLOT_READY && saveDue && slot.dirty.exchange(false)) {
+					writeChunk(slot);
+				}
+			}
+			releaseSlots();
+			copyChunks(1);
+
+			if(saveDue && m_file) fflush(m_file);
+		}
+
+	private:
+		Slot* access(int position)
+		{
+			int chunk = position / CHUNK_SIZE;
+			if(chunk != m_currentChunk) {
+				m_currentChunk = chunk;
+				prefetch(chunk);
+			}
+			for(Slot& slot : m_slots) {
+				if(slot.chunk == chunk && slot.state.load(std::memory_order_acquire) == SLOT_READY) return &slot;
+			}
+			// No slot may have been free when the chunk was reached
+			prefetch(chunk);
+			return NULL;
+		}
+
+		// Releases the chunks left behind and requests the one being played
+		// and the next one
+		void prefetch(int chunk)
+		{
+			for(int s = 1; s < SLOTS; s++) {
+				Slot& slot = m_slots[s];
+				if(slot.chunk == chunk || slot.chunk == chunk + 1) continue;
+				if(slot.state.load(std::memory_order_acquire) == SLOT_READY) {
+					slot.state.store(SLOT_RELEASING, std::memory_order_release);
+				}
+			}
+			request(chunk);
+			request(chunk + 1);
+		}
+
+		void request(int chunk)
+		{
+			if(chunk <= 0 || chunk >= CHUNKS) return;
+
+			Slot* freeSlot = NULL;
+			for(int s = 1; s < SLOTS; s++) {
+				Slot& slot = m_slots[s];
+				int state = slot.state.load(std::memory_order_acquire);
+				if(slot.chunk == chunk && (state == SLOT_LOADING || state == SLOT_READY)) return;
+				if(state == SLOT_FREE && ! freeSlot) freeSlot = &slot;
+			}
+			if(! freeSlot) return;
+
+			freeSlot->chunk = chunk;
+			freeSlot->dirty = false;
+			freeSlot->state.store(SLOT_LOADING, std::memory_order_release);
+		}
+
+		void releaseSlots()
+		{
+			for(Slot& slot : m_slots) {
+				if(slot.state.load(std::memory_order_acquire) != SLOT_RELEASING) continue;
+				if(slot.dirty.exchange(false)) writeChunk(slot);
+				slot.state.store(SLOT_FREE, std::memory_order_release);
+			}
+		}
+
+		void readChunk(Slot& slot)
+		{
+			FILE* file = m_source && ! m_copied[slot.chunk] ? m_source : m_file;
+			readChunk(file, slot.chunk, slot.data);
+		}
+
+		// Parts of the chunk past the end of the file read as zeros
+		static void readChunk(FILE* file, int chunk, float* data)
+		{
+			size_t count = 0;
+			if(file && fseek(file, (long) chunk * CHUNK_SIZE * sizeof(float), SEEK_SET) == 0) {
+				count = fread(data, sizeof(float), CHUNK_SIZE, file);
+			}
+			std::fill(data + count, data + CHUNK_SIZE, 0.f);
+		}
+
+		void writeChunk(Slot& slot)
+		{
+			int count = clamp(m_size.load(std::memory_order_relaxed) - slot.chunk * CHUNK_SIZE, 0, CHUNK_SIZE);
+			if(count == 0 || ! detach()) return;
+			if(fseek(m_file, (long) slot.chunk * CHUNK_SIZE * sizeof(float), SEEK_SET) == 0) {
+				fwrite(slot.data, sizeof(float), count, m_file);
+			}
+			m_copied[slot.chunk] = true;
+		}
+
+		// Moves a shared memory to a new file before it's modified, returns
+		// false if there's no file to write to. Saved files are complete,
+		// a shared file is never the new file of another one.
+		bool detach()
+		{
+			if(! m_shared) return m_file != NULL;
+
+			std::string fileName = memoryStreamFiles.create();
+			FILE* file = fopen(MemoryStreamFiles::getPath(fileName).c_str(), "w+b");
+			if(! file) {
+				memoryStreamFiles.close(fileName);
+				return false;
+			}
+
+			// The shared file stays open as the source of the chunks
+			long fileSize = 0;
+			if(m_file && fseek(m_file, 0, SEEK_END) == 0) fileSize = ftell(m_file);
+			long chunkBytes = CHUNK_SIZE * sizeof(float);
+			m_source = m_file;
+			m_sourceName = m_fileName;
+			m_sourceChunks = std::min<long>((fileSize + chunkBytes - 1) / chunkBytes, CHUNKS);
+			std::fill(m_copied, m_copied + CHUNKS, false);
+			if(! m_source) closeSource();
+
+			m_file = file;
+			m_fileName = fileName;
+			m_shared = false;
+			return true;
+		}
+
+		// Copies up to count chunks from the source, the chunks written
+		// since the memory moved are already in the new file
+		void copyChunks(int count)
+		{
+			for(int chunk = 0; m_source && chunk < m_sourceChunks && count > 0; chunk++) {
+				if(m_copied[chunk]) continue;
+				readChunk(m_source, chunk, m_copyBuffer);
+				if(fseek(m_file, (long) chunk * CHUNK_SIZE * sizeof(float), SEEK_SET) == 0) {
+					fwrite(m_copyBuffer, sizeof(float), CHUNK_SIZE, m_file);
+				}
+				m_copied[chunk] = true;
+				count--;
+			}
+			if(m_source && std::find(m_copied, m_copied + m_sourceChunks, false) == m_copied + m_sourceChunks) {
+				closeSource();
+			}
+		}
+
+		void closeSource()
+		{
+			if(m_source) fclose(m_source);
+			m_source = NULL;
+			if(! m_sourceName.empty()) memoryStreamFiles.close(m_sourceName);
+			m_sourceName.clear();
+		}
+};
+
+// Single thread reading and writing the files of every streamed memory
+struct MemoryStreamWorker {
+	std::mutex mutex;
+	std::vector<StreamedMemoryBank*> banks;
+	std::thread thread;
+	// Incremented to ask the running thread to stop
+	std::atomic<int> generation;
+
+	MemoryStreamWorker() {
+		generation = 0;
+	}
+
+	void add(StreamedMemoryBank* bank) {
+		std::lock_guard<std::mutex> lock(mutex);
+		banks.push_back(bank);
+		if(! thread.joinable()) {
+			thread = std::thread(&MemoryStreamWorker::run, this, generation.load());
+		}
+	}
+
+	void remove(StreamedMemoryBank* bank) {
+		std::thread stoppedThread;
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			banks.erase(std::remove(banks.begin(), banks.end(), bank), banks.end());
+			if(banks.empty() && thread.joinable()) {
+				generation++;
+				stoppedThread = std::move(thread);
+			}
+		}
+		if(stoppedThread.joinable()) stoppedThread.join();
+	}
+
+	void run(int threadGeneration) {
+		memoryStreamFiles.collect();
+
+		auto lastTime = std::chrono::steady_clock::now();
+		while(generation == threadGeneration) {
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+			auto now = std::chrono::steady_clock::now();
+			float elapsed = std::chrono::duration<float>(now - lastTime).count();
+			lastTime = now;
+
+			std::lock_guard<std::mutex> lock(mutex);
+			for(StreamedMemoryBank* bank : banks) {
+				bank->service(elapsed);
+			}
+		}
+	}
+};
+
+static MemoryStreamWorker memoryStreamWorker;
+
+StreamedMemoryBank::StreamedMemoryBank(const std::string& fileName, int size) {
+	if(! MemoryStreamFiles::isStreamFile(fileName)) {
+		m_fileName = memoryStreamFiles.create();
+		m_file = fopen(MemoryStreamFiles::getPath(m_fileName).c_str(), "w+b");
+		m_shared = false;
+	}
+	else {
+		memoryStreamFiles.open(fileName);
+		m_fileName = fileName;
+		m_file = fopen(MemoryStreamFiles::getPath(m_fileName).c_str(), "rb");
+		m_shared = true;
+	}
+
+	// Patches are saved once every modified chunk is written, a file can
+	// only be shorter if it went missing
+	long fileSize = 0;
+	if(m_file && fseek(m_file, 0, SEEK_END) == 0) fileSize = ftell(m_file);
+	m_size = clamp(size, 0, (int) std::min<long>(fileSize / sizeof(float), MAX_SIZE));
+
+	for(Slot& slot : m_slots) {
+		slot.data = new float[CHUNK_SIZE];
+		slot.chunk = -1;
+		slot.state = SLOT_FREE;
+		slot.dirty = false;
+	}
+	m_copyBuffer = new float[CHUNK_SIZE];
+	// The first chunk is read right away, playback starts there
+	m_slots[0].chunk = 0;
+	readChunk(m_slots[0]);
+	m_slots[0].state = SLOT_READY;
+
+	memoryStreamWorker.add(this);
+}
+
+StreamedMemoryBank::~StreamedMemoryBank() {
+	memoryStreamWorker.remove(this);
+	// Changes since the last save belong to no saved patch, they are
+	// dropped along with a file that was never saved
+	for(Slot& slot : m_slots) {
+		delete[] slot.data;
+	}
+	delete[] m_copyBuffer;
+	closeSource();
+	if(m_file) fclose(m_file);
+	memoryStreamFiles.close(m_fileName);
+}
+
+std::string StreamedMemoryBank::save() {
+	std::lock_guard<std::mutex> lock(memoryStreamWorker.mutex);
+	for(Slot& slot : m_slots) {
+		int state = slot.state.load(std::memory_order_acquire);
+		if((state == SLOT_READY || state == SLOT_RELEASING) && slot.dirty.exchange(false)) {
+			writeChunk(slot);
+		}
+	}
+	copyChunks(CHUNKS);
+	if(m_file) {
+		fflush(m_file);
+		m_shared = true;
+	}
+	return m_fileName;
+}
+
 struct PureNoiseSource {
 	float getValue() {
 		return 2.0 * random::normal();
 	}
 };
 
+// Draws values following the distribution of the recorded memory. The
+// histogram of the memory is turned into an alias table, so a value costs
+// the same whatever the shape of the distribution. Tables are built out of
+// the audio thread into the inactive one of two buffers, then swapped.
 struct StatisticNoiseSource {
-	int m_max_size;
-	
-	MemoryBank *m_memory;
-	std::vector<float> noiseTable;
+	static const int BINS = 256;
+	static constexpr float MIN_VOLTAGE = -10.f;
+	static constexpr float MAX_VOLTAGE = 10.f;
+
+	struct AliasTable {
+		float probabilities[BINS];
+		int aliases[BINS];
+	};
 
-	StatisticNoiseSource(int maxSize) {
-		m_memory = new MemoryBank(maxSize);
+	AliasTable tables[2];
+	// Table getValue() reads from, -1 until one has been built
+	std::atomic<int> activeTable;
+	// Last table the audio thread read from, the other one is free
+	std::atomic<int> consumedTable;
+
+	StatisticNoiseSource() {
+		activeTable = -1;
+		consumedTable = -1;
+	}
+
+	bool isReady() {
+		return activeTable.load(std::memory_order_acquire) >= 0;
 	}
 
-	~StatisticNoiseSource() {
-		delete m_memory;
+	// True once the audio thread moved to the active table
+	bool isTableConsumed() {
+		return consumedTable.load(std::memory_order_acquire) == activeTable.load(std::memory_order_relaxed);
 	}
 
 	float getValue() {
-		return 0.f;
+		int active = activeTable.load(std::memory_order_acquire);
+		// Reads from the previous table are all done by now
+		if(consumedTable.load(std::memory_order_relaxed) != active) consumedTable.store(active, std::memory_order_release);
+		const AliasTable& table = tables[active];
+		float r = random::uniform() * BINS;
+		int bin = std::min((int) r, BINS - 1);
+		// The fractional part is uniform too, it picks the bin or its alias
+		if(r - bin >= table.probabilities[bin]) bin = table.aliases[bin];
+		// Spread values over the width of the bin
+		return MIN_VOLTAGE + (bin + random::uniform()) * (MAX_VOLTAGE - MIN_VOLTAGE) / BINS;
 	}
 
 	/**
-	 * Append memory to stats, after a clear for example, or each x samples
+	 * Builds a table from all lanes of the memory, noiseAmount being the
+	 * share of values spread evenly over the voltage range. Keeps the
+	 * current table and returns false if the memory is empty.
+	 * Streamed memories are sampled from their first chunk.
+	 * The table being built is the one the audio thread used before, so
+	 * nothing is built until it read from the active one.
 	 */
-	void append(MemoryBank &addedMemory) {
-		if(addedMemory.size() + m_memory->size() > m_max_size) return;
+	bool generateNewNoiseTable(const MemoryStorage& memory, float noiseAmount) {
+		if(! isTableConsumed()) return false;
+
+		double probabilities[BINS] = {};
+		int count = 0;
+
+		for(int lane = 0; lane < memory.lanes(); lane++) {
+			const float* data = memory.head(lane);
+			int size = std::min(memory.size(lane), (int) MemoryStorage::HEAD_SIZE);
+			for(int x = 0; x < size; x++) {
+				int bin = (int) ((data[x] - MIN_VOLTAGE) * BINS / (MAX_VOLTAGE - MIN_VOLTAGE));
+				probabilities[clamp(bin, 0, BINS - 1)] += 1.0;
+			}
+			count += size;
+		}
+		if(count == 0) return false;
 
-		// Append memory
+		for(int b = 0; b < BINS; b++) {
+			probabilities[b] = (1.0 - noiseAmount) * probabilities[b] / count + noiseAmount / BINS;
+		}
+
+		int next = activeTable < 0 ? 0 : 1 - activeTable;
+		buildAliasTable(probabilities, tables[next]);
+		activeTable.store(next, std::memory_order_release);
+		return true;
 	}
 
-	void generateNewNoiseTable(float noiseAmount, int size) {
-		// Create a new noise table
+	// Vose's alias method
+	static void buildAliasTable(const double* probabilities, AliasTable& table) {
+		double scaled[BINS];
+		int small[BINS];
+		int large[BINS];
+		int smallCount = 0;
+		int largeCount = 0;
+
+		for(int b = 0; b < BINS; b++) {
+			scaled[b] = probabilities[b] * BINS;
+			if(scaled[b] < 1.0) small[smallCount++] = b;
+			else large[largeCount++] = b;
+		}
+
+		while(smallCount > 0 && largeCount > 0) {
+			int s = small[--smallCount];
+			int l = large[--largeCount];
+			table.probabilities[s] = scaled[s];
+			table.aliases[s] = l;
+			scaled[l] += scaled[s] - 1.0;
+			if(scaled[l] < 1.0) small[smallCount++] = l;
+			else large[largeCount++] = l;
+		}
+
+		// Leftovers are only off by rounding errors
+		while(largeCount > 0) {
+			int l = large[--largeCount];
+			table.probabilities[l] = 1.f;
+			table.aliases[l] = l;
+		}
+		while(smallCount > 0) {
+			int s = small[--smallCount];
+			table.probabilities[s] = 1.f;
+			table.aliases[s] = s;
+		}
 	}
 };
 
@@ -121,9 +896,19 @@ struct Mem : Module {
 		NUM_LIGHTS
 	};
 
-	static const int MEMORY_OPTIONS = 23;
-	const int MEMORY_SIZES[23] = {1,2,3,4,6,7,8,12,13,16,23,32,42,48,64,96,128,256,1024,2048,4096,8192,16384};
+	static const int MEMORY_OPTIONS = 27;
+	const int MEMORY_SIZES[27] = {1,2,3,4,6,7,8,12,13,16,23,32,42,48,64,96,128,256,1024,2048,4096,8192,16384,65536,262144,1048576,4194304};
 	static const int DEFAULT_MEMORY_SIZE = 16; //_INDEX
+	// Larger memories are streamed from a file in the user folder
+	static const int MAX_RESIDENT_SIZE = MemoryStorage::HEAD_SIZE;
+
+	// One lane of memory per channel of the trigger input
+	static const int LANES = 16;
+	static const int LANE_GROUPS = LANES / 4;
+
+	// Memory is saved as raw float32 since format 1, format 0 patches hold
+	// 8 bytes per value of which only the first half is meaningful
+	static const int MEMORY_FORMAT = 1;
 
 	static const int PROCESS_BUFFER_SIZE = 32;
 	static const int IDLE_BUFFER_SIZE = 1152000;
@@ -131,23 +916,56 @@ struct Mem : Module {
 	int processBuffer = 0;
 	int idleBuffer = 0;
 
-	dsp::SchmittTrigger trigTrigger;
-	dsp::SchmittTrigger clearTrigger;
-	dsp::SchmittTrigger resetTrigger;
+	// Triggers are detected on 4 lanes at once
+	dsp::TSchmittTrigger<float_4> trigTriggers[LANE_GROUPS];
+	dsp::TSchmittTrigger<float_4> clearTriggers[LANE_GROUPS];
+	dsp::TSchmittTrigger<float_4> resetTriggers[LANE_GROUPS];
 
 	bool isIdle = true;
 
-	bool isReading = false;
-	bool isWriting = false;
-	bool isRandomizing = false;
+	// Bit l is set when lane l is in that state
+	int readingLanes = 0;
+	int writingLanes = 0;
+	int randomizingLanes = 0;
 
 	bool isInputConnected = false;
 	bool isWriteConnected = false;
 
-	MemoryBank* memory;
+	// Save memory as 16 bits floats, halving its size in the patch
+	bool compactMemory = false;
+
+	// Past the memory, draw values following the recorded ones instead of
+	// a normal distribution. Tables are rebuilt by the UI thread on request.
+	bool statisticNoise = false;
+	std::atomic<bool> statisticsRequested;
+	static constexpr float STATISTIC_SPREAD = 0.02f;
+
+	MemoryStorage* memory;
 	int memorySize = MEMORY_SIZES[DEFAULT_MEMORY_SIZE];
-	float currentOutputValue = 0.f;
-	int position = -1;
+
+	// Banks are allocated and freed outside of the audio thread : a new
+	// bank is handed over through pendingMemory, process() swaps it in and
+	// hands the previous one back through retiredMemory
+	std::atomic<MemoryStorage*> pendingMemory;
+	std::atomic<MemoryStorage*> retiredMemory;
+	// Whether the pending bank took over the current content (resize) or
+	// already holds its own (patch load)
+	std::atomic<bool> pendingKeepsContent;
+	// A resized bank is filled by the UI thread, process() only adds the
+	// values recorded since. Clears are counted per lane, a lane cleared
+	// in the meantime is recorded again from its start.
+	std::atomic<int> clearCounts[LANES];
+	int pendingClearCounts[LANES];
+	// Size applied along with the pending bank, or alone when a streamed
+	// memory is resized
+	std::atomic<int> pendingMemorySize;
+	// Last bank handed over, only used by the UI thread
+	int allocatedLanes = 1;
+	bool allocatedStreamed = false;
+
+	int channels = 1;
+	float outputValues[LANES];
+	int positions[LANES];
 
 	PureNoiseSource noiseSource;
 	StatisticNoiseSource* statisticSource;
@@ -156,19 +974,35 @@ struct Mem : Module {
 		config(NUM_PARAMS, NUM_INPUTS, NUM_OUTPUTS, NUM_LIGHTS);
 
 		memory = new MemoryBank(MEMORY_SIZES[DEFAULT_MEMORY_SIZE]);
-		statisticSource = new StatisticNoiseSource(MEMORY_SIZES[MEMORY_OPTIONS - 2]);
+		pendingMemory = NULL;
+		retiredMemory = NULL;
+		pendingKeepsContent = false;
+		pendingMemorySize = 0;
+		statisticSource = new StatisticNoiseSource;
+		statisticsRequested = false;
+
+		for(int l = 0; l < LANES; l++) {
+			outputValues[l] = 0.f;
+			positions[l] = -1;
+			clearCounts[l] = 0;
+			pendingClearCounts[l] = 0;
+		}
 	}
 	
 	~Mem() {
 		delete memory;
+		delete pendingMemory.load();
+		delete retiredMemory.load();
 		delete statisticSource;
 	}
 
-	void reset() {
-		position = -1;
-		isReading = false;
-		isRandomizing = false;
-		isWriting = false;
+	void reset(int lanes) {
+		for(int l = 0; l < LANES; l++) {
+			if(lanes & (1 << l)) positions[l] = -1;
+		}
+		readingLanes &= ~lanes;
+		randomizingLanes &= ~lanes;
+		writingLanes &= ~lanes;
 	}
 
 	void process(const ProcessArgs &args) override {
@@ -176,64 +1010,109 @@ struct Mem : Module {
 		if(processBuffer == 0) processTimely(args);
 		if(idleBuffer == 0) processIdle(args);
 
-		bool writeGate = isWriteConnected && inputs[WRITE_INPUT].getNormalVoltage(0.f) >= 1.f;
+		if(pendingMemory.load(std::memory_order_acquire) || pendingMemorySize.load(std::memory_order_relaxed)) {
+			applyPendingMemory();
+		}
 
-		if (clearTrigger.process(inputs[CLEAR_INPUT].getVoltage())) {
-			// TODO Add to stats
-			memory->clear();
-			reset();
+		int clearMask = detectTriggers(inputs[CLEAR_INPUT], clearTriggers);
+		if (clearMask) {
+			// Statistics keep the last table built until the new memory fills up
+			for(int l = 0; l < memory->lanes(); l++) {
+				if(clearMask & (1 << l)) {
+					memory->clear(l);
+					clearCounts[l].fetch_add(1, std::memory_order_release);
+				}
+			}
+			reset(clearMask);
 		}
 
-		if (resetTrigger.process(inputs[RESET_INPUT].getVoltage())) {
-			reset();
+		int resetMask = detectTriggers(inputs[RESET_INPUT], resetTriggers);
+		if (resetMask) {
+			reset(resetMask);
 		}
 
-		if (trigTrigger.process(inputs[TRIG_INPUT].getVoltage())) {
+		int trigMask = detectTriggers(inputs[TRIG_INPUT], trigTriggers);
+		if (trigMask) {
 			isIdle = false;
 			idleBuffer = IDLE_BUFFER_SIZE;
-			position++;
 
-			if((memory->size() > position) && ! writeGate) {
-				isReading = true;
-				isWriting = false;
-				isRandomizing = false;
-				currentOutputValue = memory->getValue(position);
-			}
-			else {
-				isReading = false;
-				if(memorySize > position) {
-					isWriting = true;
-					// we have still some place left
-					if(isInputConnected) {
-						currentOutputValue = inputs[INPUT_INPUT].getVoltage();
-					}
-					else {
-						isRandomizing = true;
-						currentOutputValue = noiseSource.getValue();
-					}
-					memory->m_memory->push_back(currentOutputValue);
-				}
-				else {
-					isWriting = false;
-					isRandomizing = true;
-					currentOutputValue = noiseSource.getValue();
-				}
+			while(trigMask) {
+				int lane = __builtin_ctz(trigMask);
+				trigMask &= trigMask - 1;
+				processTrigger(lane);
 			}
-			
 		}
 		else {
 			idleBuffer--;
 		}
 
-		lights[WRITE_LIGHT].setBrightness(isWriting ? 1.f : 0.f);
-		lights[READ_LIGHT].setBrightness(isReading ? 1.f : 0.f);
-		lights[NOISE_LIGHT].setBrightness(isRandomizing && ! isIdle ? 1.f : 0.f);
+		lights[WRITE_LIGHT].setBrightness(writingLanes ? 1.f : 0.f);
+		lights[READ_LIGHT].setBrightness(readingLanes ? 1.f : 0.f);
+		lights[NOISE_LIGHT].setBrightness(randomizingLanes && ! isIdle ? 1.f : 0.f);
 
-		outputs[OUTPUT_OUTPUT].setVoltage(currentOutputValue);
+		for(int c = 0; c < channels; c += 4) {
+			outputs[OUTPUT_OUTPUT].setVoltageSimd(float_4::load(&outputValues[c]), c);
+		}
 
 		processBuffer--;
 	}
 
+	// Returns a bitmask of the lanes that crossed the trigger threshold,
+	// a monophonic input triggers all lanes
+	int detectTriggers(Input& input, dsp::TSchmittTrigger<float_4>* triggers) {
+		int mask = 0;
+		for(int c = 0; c < channels; c += 4) {
+			float_4 triggered = triggers[c / 4].process(input.getPolyVoltageSimd<float_4>(c));
+			mask |= simd::movemask(triggered) << c;
+		}
+		return mask & ((1 << channels) - 1);
+	}
+
+	void processTrigger(int lane) {
+		int bit = 1 << lane;
+		int position = ++positions[lane];
+		// Lanes the bank has no room for yet behave as a full memory
+		bool hasLane = lane < memory->lanes();
+		bool writeGate = isWriteConnected && inputs[WRITE_INPUT].getPolyVoltage(lane) >= 1.f;
+		float value;
+
+		if(hasLane && (memory->size(lane) > position) && ! writeGate) {
+			readingLanes |= bit;
+			writingLanes &= ~bit;
+			randomizingLanes &= ~bit;
+			value = memory->getValue(position, lane);
+		}
+		else {
+			readingLanes &= ~bit;
+			if(hasLane && memorySize > position) {
+				writingLanes |= bit;
+				// we have still some place left
+				if(isInputConnected) {
+					value = inputs[INPUT_INPUT].getPolyVoltage(lane);
+				}
+				else {
+					randomizingLanes |= bit;
+					value = noiseSource.getValue();
+				}
+				memory->push(value, lane);
+				// A full memory is a good time to take statistics
+				if(statisticNoise && memory->size(lane) == memorySize) statisticsRequested = true;
+			}
+			else {
+				writingLanes &= ~bit;
+				randomizingLanes |= bit;
+				value = getNoiseValue();
+			}
+		}
+
+		outputValues[lane] = value;
+	}
+
+	float getNoiseValue() {
+		if(statisticNoise && statisticSource->isReady()) return statisticSource->getValue();
+		return noiseSource.getValue();
+	}
+
 
 	/**
 	 * Part of the process only executed every PROCESS_BUFFER samples
@@ -244,7 +1123,8 @@ struct Mem : Module {
 		isWriteConnected = inputs[WRITE_INPUT].isConnected();
 		isInputConnected = inputs[INPUT_INPUT].isConnected();
 
-		// swap noise statistics taken 
+		channels = clamp(inputs[TRIG_INPUT].getChannels(), 1, LANES);
+		outputs[OUTPUT_OUTPUT].setChannels(channels);
 
 		processBuffer = PROCESS_BUFFER_SIZE;
 	}
@@ -255,6 +1135,8 @@ struct Mem : Module {
 	 */
 	void processIdle(const ProcessArgs &args) {
 
+		if(statisticNoise) statisticsRequested = true;
+
 		idleBuffer = IDLE_BUFFER_SIZE;
 		isIdle = true;
 	}
@@ -262,53 +1144,244 @@ struct Mem : Module {
 
 	json_t *dataToJson() override {
 		json_t *rootJ = json_object();
-
-		json_object_set_new(rootJ, "outputValue", json_real(currentOutputValue));
-		json_object_set_new(rootJ, "position", json_integer(position));
+		int lanes = memory->lanes();
+
+		// Monophonic memories are saved as they were before lanes existed
+		if(lanes == 1) {
+			json_object_set_new(rootJ, "outputValue", json_real(outputValues[0]));
+			json_object_set_new(rootJ, "position", json_integer(positions[0]));
+			StreamedMemoryBank* stream = dynamic_cast<StreamedMemoryBank*>(memory);
+			if(stream) {
+				// Values stay in the stream file, the patch only points to it
+				std::string streamFile = stream->save();
+				memoryStreamFiles.addReference(streamFile, APP->patch->path);
+
+				json_object_set_new(rootJ, "memoryStream", json_string(streamFile.c_str()));
+				json_object_set_new(rootJ, "streamSize", json_integer(memory->size(0)));
+			}
+			else {
+				json_object_set_new(rootJ, "memory", json_string(encodeMemory(*memory, 0).c_str()));
+			}
+		}
+		else {
+			json_t* outputValuesJ = json_array();
+			json_t* positionsJ = json_array();
+			json_t* memoryJ = json_array();
+			for(int l = 0; l < lanes; l++) {
+				json_array_append_new(outputValuesJ, json_real(outputValues[l]));
+				json_array_append_new(positionsJ, json_integer(positions[l]));
+				json_array_append_new(memoryJ, json_string(encodeMemory(*memory, l).c_str()));
+			}
+			json_object_set_new(rootJ, "outputValue", outputValuesJ);
+			json_object_set_new(rootJ, "position", positionsJ);
+			json_object_set_new(rootJ, "memory", memoryJ);
+		}
 		
-		uint8_t *memoryData;
-		memoryData = reinterpret_cast<uint8_t*>(memory->data());
-		int memoryByteSize = memory->size() * 8;
-		std::string memoryStr = string::toBase64(memoryData, memoryByteSize);
-		json_object_set_new(rootJ, "memory", json_string(memoryStr.c_str()));
+		json_object_set_new(rootJ, "memoryFormat", json_integer(MEMORY_FORMAT));
+		json_object_set_new(rootJ, "memoryEncoding", json_string(compactMemory ? "float16" : "float32"));
 		json_object_set_new(rootJ, "memorySize", json_integer(memorySize));
-		json_object_set_new(rootJ, "memoryByteSize", json_integer(memoryByteSize));
 
-		json_object_set_new(rootJ, "isWriting", json_boolean(isWriting));
-		json_object_set_new(rootJ, "isReading", json_boolean(isReading));
-		json_object_set_new(rootJ, "isRandomizing", json_boolean(isReading));
+		json_object_set_new(rootJ, "statisticNoise", json_boolean(statisticNoise));
+
+		json_object_set_new(rootJ, "isWriting", json_boolean(writingLanes != 0));
+		json_object_set_new(rootJ, "isReading", json_boolean(readingLanes != 0));
+		json_object_set_new(rootJ, "isRandomizing", json_boolean(readingLanes != 0));
 
 		return rootJ;
 	}
 
 	void dataFromJson(json_t *rootJ) override {
 
-		currentOutputValue = json_real_value(json_object_get(rootJ, "outputValue"));
-		position = json_integer_value(json_object_get(rootJ, "position"));
-		memorySize = json_integer_value(json_object_get(rootJ, "memorySize"));
+		int memorySize = json_integer_value(json_object_get(rootJ, "memorySize"));
+		if(memorySize <= 0) memorySize = MEMORY_SIZES[DEFAULT_MEMORY_SIZE];
 
 		// memory
-		unsigned long memoryByteSize = json_integer_value(json_object_get(rootJ, "memoryByteSize"));
-		std::string memoryStr = json_string_value(json_object_get(rootJ, "memory"));
-		std::vector<uint8_t> memoryVector = string::fromBase64(memoryStr);
-		float* actualData = reinterpret_cast<float*>(memoryVector.data());
+		int format = json_integer_value(json_object_get(rootJ, "memoryFormat"));
+		json_t* encodingJ = json_object_get(rootJ, "memoryEncoding");
+		compactMemory = json_is_string(encodingJ) && std::string(json_string_value(encodingJ)) == "float16";
+
+		json_t* memoryJ = json_object_get(rootJ, "memory");
+		json_t* streamJ = json_object_get(rootJ, "memoryStream");
+		json_t* outputValueJ = json_object_get(rootJ, "outputValue");
+		json_t* positionJ = json_object_get(rootJ, "position");
+
+		if(json_is_string(streamJ)) {
+			// The file stays as the patch saved it, duplicates share it
+			// until they write. Unknown names start an empty memory.
+			std::string streamFile = json_string_value(streamJ);
+
+			int streamSize = json_integer_value(json_object_get(rootJ, "streamSize"));
+			outputValues[0] = json_real_value(outputValueJ);
+			positions[0] = json_integer_value(positionJ);
+			installMemory(new StreamedMemoryBank(streamFile, streamSize), false, memorySize);
+		}
+		else if(json_is_array(memoryJ)) {
+			memorySize = std::min(memorySize, (int) MAX_RESIDENT_SIZE);
+			int lanes = clamp((int) json_array_size(memoryJ), 1, LANES);
+			MemoryBank* loadedMemory = new MemoryBank(memorySize, lanes);
+			for(int l = 0; l < lanes; l++) {
+				json_t* laneJ = json_array_get(memoryJ, l);
+				decodeMemory(string::fromBase64(laneJ ? json_string_value(laneJ) : ""), compactMemory, *loadedMemory, l);
+				outputValues[l] = json_real_value(json_array_get(outputValueJ, l));
+				positions[l] = json_integer_value(json_array_get(positionJ, l));
+			}
+			installMemory(loadedMemory, false, memorySize);
+		}
+		else {
+			memorySize = std::min(memorySize, (int) MAX_RESIDENT_SIZE);
+			std::vector<uint8_t> bytes = string::fromBase64(memoryJ ? json_string_value(memoryJ) : "");
+			MemoryBank* loadedMemory = new MemoryBank(memorySize);
+			if(format == 0) {
+				unsigned long memoryByteSize = json_integer_value(json_object_get(rootJ, "memoryByteSize"));
+				int count = std::min<size_t>(memoryByteSize / 8, bytes.size() / sizeof(float));
+				loadedMemory->fill(reinterpret_cast<const float*>(bytes.data()), count);
+			}
+			else {
+				decodeMemory(bytes, compactMemory, *loadedMemory, 0);
+			}
+			outputValues[0] = json_real_value(outputValueJ);
+			positions[0] = json_integer_value(positionJ);
+			installMemory(loadedMemory, false, memorySize);
+		}
+
+		statisticNoise = json_is_true(json_object_get(rootJ, "statisticNoise"));
+		statisticsRequested = statisticNoise;
 
-		memory = new MemoryBank(memorySize);
-		for(unsigned long x = 0; x < memoryByteSize / 8; x++) {
-			memory->m_memory->push_back(actualData[x]);
+		int lanesMask = (1 << LANES) - 1;
+		writingLanes = json_is_true(json_object_get(rootJ, "isWriting")) ? lanesMask : 0;
+		readingLanes = json_is_true(json_object_get(rootJ, "isReading")) ? lanesMask : 0;
+		randomizingLanes = json_is_true(json_object_get(rootJ, "isRandomizing")) ? lanesMask : 0;
+	}
+
+	// Rack only runs on little endian hosts, the memory buffer is saved
+	// and restored as is
+	std::string encodeMemory(const MemoryStorage& bank, int lane) {
+		int count = bank.size(lane);
+		const float* values = bank.head(lane);
+		if(compactMemory) {
+			std::vector<uint16_t> halves(count);
+			for(int x = 0; x < count; x++) {
+				halves[x] = floatToHalf(values[x]);
+			}
+			return string::toBase64(reinterpret_cast<const uint8_t*>(halves.data()), count * sizeof(uint16_t));
 		}
+		return string::toBase64(reinterpret_cast<const uint8_t*>(values), count * sizeof(float));
+	}
 
-		isWriting = json_is_true(json_object_get(rootJ, "isWriting"));
-		isReading = json_is_true(json_object_get(rootJ, "isReading"));
-		isRandomizing = json_is_true(json_object_get(rootJ, "isRandomizing"));
+	void decodeMemory(const std::vector<uint8_t>& bytes, bool compact, MemoryBank& bank, int lane) {
+		if(compact) {
+			const uint16_t* halves = reinterpret_cast<const uint16_t*>(bytes.data());
+			int count = bytes.size() / sizeof(uint16_t);
+			for(int x = 0; x < count && bank.push(halfToFloat(halves[x]), lane); x++);
+		}
+		else {
+			bank.fill(reinterpret_cast<const float*>(bytes.data()), bytes.size() / sizeof(float), lane);
+		}
 	}
 
 	void setMemorySize(int size) {
-		MemoryBank* newMemory = new MemoryBank(size);
-		newMemory->fill(memory->m_memory);
-		delete memory;
+		if(size <= MAX_RESIDENT_SIZE) {
+			installMemory(new MemoryBank(size, allocatedLanes), true, size);
+		}
+		else if(allocatedStreamed) {
+			// The file holds any size, only the limit changes
+			pendingMemorySize = size;
+		}
+		else {
+			installMemory(new StreamedMemoryBank("", 0), true, size);
+		}
+	}
+
+	/**
+	 * Called from the UI thread when the trigger input went polyphonic, 
+	 * monophonic memories don't pay for 16 lanes. Streamed memories stay
+	 * monophonic.
+	 */
+	void updateLanes() {
+		if(channels > allocatedLanes && ! allocatedStreamed) {
+			installMemory(new MemoryBank(memorySize, LANES), true, memorySize);
+		}
+	}
+
+	/**
+	 * Called from the UI thread, the bank is swapped in on the next sample
+	 */
+	void installMemory(MemoryStorage* newMemory, bool keepContent, int size) {
+		collectRetiredMemory();
+		// Once the previous pending bank is taken back here, process() can't pick it anymore
+		delete pendingMemory.exchange(NULL);
+		if(keepContent) {
+			// Clears are read first, a lane cleared during the copy is
+			// then noticed by process()
+			for(int l = 0; l < LANES; l++) {
+				pendingClearCounts[l] = clearCounts[l].load(std::memory_order_acquire);
+			}
+			newMemory->fill(*memory);
+		}
+		allocatedLanes = newMemory->lanes();
+		allocatedStreamed = dynamic_cast<StreamedMemoryBank*>(newMemory) != NULL;
+		pendingKeepsContent = keepContent;
+		pendingMemorySize = size;
+		pendingMemory.store(newMemory, std::memory_order_release);
+	}
+
+	/**
+	 * Called from the UI thread, before retired banks are freed
+	 */
+	void updateStatistics() {
+		// The request stays pending until the last table was picked up
+		if(! statisticSource->isTableConsumed()) return;
+		if(! statisticsRequested.exchange(false)) return;
+		statisticSource->generateNewNoiseTable(*memory, STATISTIC_SPREAD);
+	}
+
+	void setStatisticNoise(bool enabled) {
+		statisticNoise = enabled;
+		if(enabled) statisticsRequested = true;
+	}
+
+	void collectRetiredMemory() {
+		delete retiredMemory.exchange(NULL);
+	}
+
+	void applyPendingMemory() {
+		if(pendingMemory.load(std::memory_order_acquire) && ! swapMemory()) return;
+
+		int size = pendingMemorySize.exchange(0);
+		if(size > 0) {
+			memorySize = size;
+			memory->truncate(size);
+		}
+	}
+
+	/**
+	 * Returns false while the previous bank is not freed yet
+	 */
+	bool swapMemory() {
+		// Wait for the UI thread to free the previous bank first
+		if(retiredMemory.load() != NULL) return false;
+
+		MemoryStorage* newMemory = pendingMemory.exchange(NULL);
+		if(! newMemory) return true;
+
+		if(pendingKeepsContent) catchUpMemory(*newMemory);
+		retiredMemory = memory;
 		memory = newMemory;
-		memorySize = size;
+		return true;
+	}
+
+	// Adds the values recorded since the UI thread filled the new bank
+	void catchUpMemory(MemoryStorage& newMemory) {
+		int lanes = std::min(memory->lanes(), newMemory.lanes());
+		for(int l = 0; l < lanes; l++) {
+			int from = newMemory.size(l);
+			if(clearCounts[l].load(std::memory_order_relaxed) != pendingClearCounts[l]) {
+				newMemory.clear(l);
+				from = 0;
+			}
+			int to = std::min(memory->size(l), (int) MemoryStorage::HEAD_SIZE);
+			for(int x = from; x < to && newMemory.push(memory->getValue(x, l), l); x++);
+		}
 	}
 };
 
@@ -325,6 +1398,22 @@ struct MemorySizeValueItem : MenuItem {
 	}
 };
 
+struct StatisticNoiseItem : MenuItem {
+	Mem* module;
+
+	void onAction(const event::Action& e) override {
+		module->setStatisticNoise(! module->statisticNoise);
+	}
+};
+
+struct CompactMemoryItem : MenuItem {
+	Mem* module;
+
+	void onAction(const event::Action& e) override {
+		module->compactMemory = ! module->compactMemory;
+	}
+};
+
 struct MemWidget : ModuleWidget {
 
 	MemWidget(Mem *module) {
@@ -349,12 +1438,35 @@ struct MemWidget : ModuleWidget {
 		addChild(createLight<MediumLight<BlueLight>>(mm2px(Vec(10, 44.2)), module, Mem::NOISE_LIGHT));
 	}
 
+	void step() override {
+		Mem* module = dynamic_cast<Mem*>(this->module);
+		if(module) {
+			module->updateStatistics();
+			module->collectRetiredMemory();
+			module->updateLanes();
+		}
+
+		ModuleWidget::step();
+	}
+
 	void appendContextMenu(Menu* menu) override {
 		Mem* module = dynamic_cast<Mem*>(this->module);
 
 		menu->addChild(new MenuSeparator);
 
-		// TODO Context menu -> add "Enable noise statistics"
+		StatisticNoiseItem* statisticItem = new StatisticNoiseItem;
+		statisticItem->text = "Noise from memory statistics";
+		statisticItem->module = module;
+		statisticItem->rightText = CHECKMARK(module->statisticNoise);
+		menu->addChild(statisticItem);
+
+		CompactMemoryItem* compactItem = new CompactMemoryItem;
+		compactItem->text = "Save memory as 16 bits";
+		compactItem->module = module;
+		compactItem->rightText = CHECKMARK(module->compactMemory);
+		menu->addChild(compactItem);
+
+		menu->addChild(new MenuSeparator);
 		
 		MenuLabel* item = new MenuLabel;
 	 	item->text = "Memory Size";
@@ -364,6 +1476,7 @@ struct MemWidget : ModuleWidget {
 		for(int x = 0; x < module->MEMORY_OPTIONS; x++) {
 			MemorySizeValueItem* menuItem = new MemorySizeValueItem(module->MEMORY_SIZES[x]);
 			std::string label = std::to_string(module->MEMORY_SIZES[x]) + " samples" ;
+			if(module->MEMORY_SIZES[x] > Mem::MAX_RESIDENT_SIZE) label += " (disk)";
 			menuItem->text = label;
 			menuItem->module = module;
 			menuItem->rightText = CHECKMARK(module->MEMORY_SIZES[x] == module->memorySize);
@@ -32,7 +32,7 @@ struct Morph : Module {
 	MidiInputOutput midiIO;
 
 	MappingProcessor mappingProcessor;
-	HandleMapCollection handleMap;
+	HandleMapCollection handleMap {NUM_PARAMS};
 	MidiMapCollection midiMap;
 
 	bool invertYMidiAxis = false;
@@ -80,6 +80,7 @@ struct Morph : Module {
 
 		mappingProcessor.params[X_PARAM] = paramQuantities[X_PARAM];
 		mappingProcessor.params[Y_PARAM] = paramQuantities[Y_PARAM];
+		mappingProcessor.setSampleRate(APP->engine->getSampleRate());
 	}
 
 	void process(const ProcessArgs& args) override {
@@ -216,6 +217,10 @@ struct Morph : Module {
 		}
 	}
 
+	void onSampleRateChange() override {
+		mappingProcessor.setSampleRate(APP->engine->getSampleRate());
+	}
+
 	void onReset() override {
 		selectorX = 0;
 		selectorY = 0;
@@ -252,6 +257,7 @@ struct Morph : Module {
 		json_object_set_new(rootJ, "midi_map", midiMap.toJson());
 		json_object_set_new(rootJ, "midi_io", midiIO.toJson());
 		json_object_set_new(rootJ, "writing_snapshot", json_integer(writingSnapshot));
+		json_object_set_new(rootJ, "mapping", mappingProcessor.toJson());
 		return rootJ;
 	}
 
@@ -290,6 +296,11 @@ struct Morph : Module {
 		if(writingSnapshotJ) {
 			writingSnapshot = json_integer_value(writingSnapshotJ);
 		}
+
+		json_t* mappingJ = json_object_get(rootJ, "mapping");
+		if(mappingJ) {
+			mappingProcessor.fromJson(mappingJ);
+		}
 	}
 };
 
@@ -533,7 +544,11 @@ struct MorphWidget : ModuleWidget {
 		if(module) {
 			MidiMenuBuilder menuBuilder;
 			menuBuilder.channel = false;
+			menuBuilder.outputRate = true;
 			menuBuilder.build(menu, &module->midiIO);
+
+			MappingMenuBuilder mappingMenuBuilder;
+			mappingMenuBuilder.build(menu, &module->mappingProcessor);
 		}
 
 		menu->addChild(new MenuSeparator);
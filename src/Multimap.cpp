@@ -7,54 +7,74 @@
 #include "widgets/lights.hpp"
 #include "widgets/ports.hpp"
 
+using simd::float_4;
+
 struct ParameterSnapshot {
 	float values[16] = {};
 };
 
+// Bank snapshots are stored from the audio thread on bank changes, so they
+// all live in fixed arrays : nothing is allocated or moved once built, and
+// toJson() can walk them from the UI thread.
 struct Snapshots {
-	std::vector<ParameterSnapshot*> snapshots;
+	static const int MAX_SNAPSHOTS = 128;
+
+	ParameterSnapshot snapshots[MAX_SNAPSHOTS];
+	// Set once a bank holds non default values
+	bool stored[MAX_SNAPSHOTS] = {};
 
 	int size = 0;
 
-	~Snapshots() {
-		reset();
-	}
+	// Values of the banks that were never stored
+	ParameterSnapshot defaults;
 
 	void reset() {
 		size = 0;
-		for(ParameterSnapshot* s : snapshots) {
-			delete s;
-		}	
-		snapshots.clear();
+		std::fill(stored, stored + MAX_SNAPSHOTS, false);
 	}
 
 	void init(int size_ = 1) {
-		for(int x = 0; x < size_; x++) {
-			ParameterSnapshot* snapshot = new ParameterSnapshot;
-			addSnapshot(snapshot);
-		}
+		size = std::min(size + size_, (int) MAX_SNAPSHOTS);
+	}
+
+	void setDefaults(const float* values) {
+		std::copy(values, values + 16, defaults.values);
 	}
 
 	bool exists(int index) {
-		return index < size;
+		return index >= 0 && index < size && stored[index];
 	}
 
-	void addSnapshot(ParameterSnapshot *snapshot) {
-		snapshots.push_back(snapshot);
-		size++;
+	const ParameterSnapshot* get(int index) {
+		if(! exists(index)) return &defaults;
+		return &snapshots[index];
 	}
 
-	void replaceSnapshot(int index, ParameterSnapshot* snapshot) {
-		delete snapshots[index];
-		snapshots[index] = snapshot;
+	void store(int index, const float* values) {
+		if(index < 0 || index >= MAX_SNAPSHOTS) return;
+		if(! exists(index)) {
+			// Default values don't need their own snapshot
+			if(std::equal(values, values + 16, defaults.values)) return;
+			size = std::max(size, index + 1);
+		}
+		std::copy(values, values + 16, snapshots[index].values);
+		stored[index] = true;
 	}
 
 	json_t* toJson() {
+		// Trailing empty banks are omitted, empty ones in between are stored as null
+		int lastIndex = size - 1;
+		while(lastIndex >= 0 && ! exists(lastIndex)) lastIndex--;
+
 		json_t *snapshotsJ = json_array();
-		for (int x = 0; x < size; x++) {
+		for (int x = 0; x <= lastIndex; x++) {
+			if(! exists(x)) {
+				json_array_append_new(snapshotsJ, json_null());
+				continue;
+			}
 			json_t* snapshotJ = json_array();
 			for(int y = 0; y < 16; y++) {
-				json_t* value = json_real(snapshots[x]->values[y]);
+				json_t* value = json_real(snapshots[x].values[y]);
 				json_array_append_new(snapshotJ, value);
 			}
 			json_array_append_new(snapshotsJ, snapshotJ);
@@ -63,22 +83,23 @@ struct Snapshots {
 	}
 
 	void fromJson(json_t* rootJ) {
-		reset();
-		int bankSize = json_array_size(rootJ);
+		std::fill(stored, stored + MAX_SNAPSHOTS, false);
+		int bankSize = std::min((int) json_array_size(rootJ), (int) MAX_SNAPSHOTS);
 		for(int x = 0; x < bankSize; x++) {
-			ParameterSnapshot* snapshot = new ParameterSnapshot;
 			json_t* snapshotJ = json_array_get(rootJ, x);
+			if(! json_is_array(snapshotJ)) continue;
+			float values[16];
 			for(int y = 0; y < 16; y++) {
-				float value = json_real_value(json_array_get(snapshotJ, y));
-				snapshot->values[y] = value;
+				values[y] = json_real_value(json_array_get(snapshotJ, y));
 			}
-			addSnapshot(snapshot);
+			store(x, values);
 		}
 	}
 };
 
 struct Multimap : Module {
 	static const int MAX_BANK = 128;
+	static const int BANK_CV_DIVISION = 32;
 
 	enum KnobModes {
 		KNOB_JUMP,
@@ -108,7 +129,7 @@ struct Multimap : Module {
 	
 	MidiInputOutput midiIO;
 	MidiMapCollection midiMap;
-	MultiHandleMapCollection handleMap;
+	MultiHandleMapCollection handleMap {NUM_PARAMS, MAX_BANK};
 
 	MappingProcessor mappingProcessor;
 
@@ -118,6 +139,15 @@ struct Multimap : Module {
 	int currentBankIndex = 0;
 	Snapshots snapshots;
 
+	// BANK_CV_INPUT is read on block boundaries, and a new bank is only loaded
+	// once the same index has been read twice in a row
+	dsp::ClockDivider bankCvDivider;
+	int pendingBankIndex = 0;
+
+	// Knob values last written to POLY_CV_OUTPUT
+	float_4 lastOutputValues[4] = {};
+	bool polyOutputDirty = true;
+
 	Multimap() {
 		config(NUM_PARAMS, NUM_INPUTS, NUM_OUTPUTS, NUM_LIGHTS);
 		init();
@@ -134,24 +164,27 @@ struct Multimap : Module {
 			handleMap.parameterIds.push_back(paramId);
 		}
 
+		mappingProcessor.setSampleRate(APP->engine->getSampleRate());
+
+		bankCvDivider.setDivision(BANK_CV_DIVISION);
+
 		outputs[POLY_CV_OUTPUT].channels = 0;
 		handleMap.init(MAX_BANK);
 		snapshots.init(MAX_BANK);
+
+		float defaults[16];
+		for(int x = 0; x < 16; x++) {
+			defaults[x] = paramQuantities[KNOBS+x]->getDefaultValue();
+		}
+		snapshots.setDefaults(defaults);
 	}
 
 	void process(const ProcessArgs& args) override {
 		
 		processTriggers();
 
-		if(inputs[BANK_CV_INPUT].isConnected()) {
-			float inputValue = math::clamp(inputs[BANK_CV_INPUT].getVoltage(), 0.f, 10.f);
-			int index = (int) rescale(inputValue, 0.f, 10.f, 0.f, 127.f);
-			if(index != currentBankIndex) {
-				storeCurrentSnapshot();
-				currentBankIndex = index;
-				handleMap.loadPage(currentBankIndex);
-				restoreSnapshot(index);
-			}
+		if(inputs[BANK_CV_INPUT].isConnected() && bankCvDivider.process()) {
+			processBankCv();
 		}
 
 		if(inputs[POLY_CV_INPUT].isConnected()) {
@@ -161,11 +194,13 @@ struct Multimap : Module {
 
 			int channels = inputs[POLY_CV_INPUT].getChannels();
 
-			// TODO : SIMD
-			for(int c = 0; c < channels; c++) {
-				float inputValue = math::clamp(inputs[POLY_CV_INPUT].getVoltage(c), 0.f, 10.f);
-				float value = rescale(inputValue, 0.f, 10.f, 0.f, 1.f);
-				params[KNOBS+c].setValue(value);
+			for(int c = 0; c < channels; c += 4) {
+				float_4 inputValue = simd::clamp(inputs[POLY_CV_INPUT].getVoltageSimd<float_4>(c), 0.f, 10.f);
+				float values[4];
+				(inputValue * 0.1f).store(values);
+				for(int x = 0; x < 4 && c + x < channels; x++) {
+					params[KNOBS+c+x].setValue(values[x]);
+				}
 			}
 		}
 		else {
@@ -175,13 +210,46 @@ struct Multimap : Module {
 		mappingProcessor.process();
 
 		if(outputs[POLY_CV_OUTPUT].isConnected()) {
-			outputs[POLY_CV_OUTPUT].channels = 16;
-			for(int c = 0; c < 16; c++) { 
-				// TODO : SIMD
-				float value = rescale(params[KNOBS+c].getValue(), 0.f, 1.f, 0.f, 10.f);
-				outputs[POLY_CV_OUTPUT].setVoltage(value, c);
+			processPolyOutput();
+		}
+		else {
+			polyOutputDirty = true;
+		}
+	}
+
+	void processBankCv() {
+		float inputValue = math::clamp(inputs[BANK_CV_INPUT].getVoltage(), 0.f, 10.f);
+		int index = (int) rescale(inputValue, 0.f, 10.f, 0.f, 127.f);
+		if(index != pendingBankIndex) {
+			// Wait for the next block to make sure the CV has settled
+			pendingBankIndex = index;
+			return;
+		}
+		if(index != currentBankIndex) {
+			storeCurrentSnapshot();
+			currentBankIndex = index;
+			handleMap.loadPage(currentBankIndex);
+			restoreSnapshot(index);
+		}
+	}
+
+	void processPolyOutput() {
+		outputs[POLY_CV_OUTPUT].channels = 16;
+
+		float values[16];
+		for(int c = 0; c < 16; c++) {
+			values[c] = params[KNOBS+c].getValue();
+		}
+
+		for(int c = 0; c < 16; c += 4) {
+			float_4 value = float_4::load(&values[c]);
+			// Only write the voltages of groups that changed since the last sample
+			if(polyOutputDirty || simd::movemask(value != lastOutputValues[c / 4])) {
+				outputs[POLY_CV_OUTPUT].setVoltageSimd(value * 10.f, c);
+				lastOutputValues[c / 4] = value;
 			}
 		}
+		polyOutputDirty = false;
 	}
 
 	void processTriggers() {
@@ -212,12 +280,7 @@ struct Multimap : Module {
 			storeCurrentSnapshot();
 			currentBankIndex++;
 			handleMap.next();
-			if(snapshots.exists(currentBankIndex)) {
-				restoreSnapshot(currentBankIndex);
-			}
-			else {
-				resetParameters();
-			}
+			restoreSnapshot(currentBankIndex);
 		}
 	}
 
@@ -231,33 +294,30 @@ struct Multimap : Module {
 	}
 
 	void restoreSnapshot(int bankIndex) {
-		ParameterSnapshot* snapshot = snapshots.snapshots[bankIndex];
+		const ParameterSnapshot* snapshot = snapshots.get(bankIndex);
 		for(int x = 0; x < 16; x++) {
 			params[KNOBS+x].setValue(snapshot->values[x]);
 		}
 	}
 
 	void storeCurrentSnapshot() {
-		ParameterSnapshot* snapshot;
-		if(snapshots.exists(currentBankIndex)) {
-			snapshot = snapshots.snapshots[currentBankIndex];
-		}
-		else {
-			snapshot = new ParameterSnapshot;		
-			snapshots.addSnapshot(snapshot);
-		}
-		
+		float values[16];
 		for(int x = 0; x < 16; x++) {
-			snapshot->values[x] = params[KNOBS+x].getValue();
+			values[x] = params[KNOBS+x].getValue();
 		}
+		snapshots.store(currentBankIndex, values);
 	}
 
 	void resetParameters() {
 		for(int x = 0; x < 16; x++) {
-			params[KNOBS+x].setValue(0.f);
+			params[KNOBS+x].setValue(snapshots.defaults.values[x]);
 		}
 	}
 	
+	void onSampleRateChange() override {
+		mappingProcessor.setSampleRate(APP->engine->getSampleRate());
+	}
+
 	void onReset() override {
 		handleMap.clear();
 		handleMap.init(MAX_BANK);
@@ -277,6 +337,7 @@ struct Multimap : Module {
 		json_object_set_new(rootJ, "snapshots", snapshots.toJson());
 		json_object_set_new(rootJ, "midi_map", midiMap.toJson());
 		json_object_set_new(rootJ, "handle_map", handleMap.toJson());
+		json_object_set_new(rootJ, "mapping", mappingProcessor.toJson());
 
 		return rootJ;
 	}
@@ -302,6 +363,9 @@ struct Multimap : Module {
 			handleMap.fromJson(handleMapJ);
 			handleMap.loadPage(currentBankIndex);
 		}
+
+		json_t* mappingJ = json_object_get(rootJ, "mapping");
+		if(mappingJ) mappingProcessor.fromJson(mappingJ);
 	}
 };
 
@@ -370,6 +434,8 @@ struct MultimapDisplay : OpaqueWidget {
 
 	void step() override {
 		if(module) {
+			module->handleMap.updateHandleColors();
+
 			// Retrieve touched parameter
 			int touchId = -1;
 			if(module->midiMap.touchedParamId > -1) {
@@ -538,7 +604,11 @@ struct MultimapWidget : ModuleWidget {
 		if(module) {
 			MidiMenuBuilder menuBuilder;
 			menuBuilder.channel = false;
+			menuBuilder.outputRate = true;
 			menuBuilder.build(menu, &module->midiIO);
+
+			MappingMenuBuilder mappingMenuBuilder;
+			mappingMenuBuilder.build(menu, &module->mappingProcessor);
 		}
 	}
 };
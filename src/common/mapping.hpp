@@ -6,6 +6,9 @@
 #include "../widgets/lights.hpp"
 #include "../widgets/labels.hpp"
 
+// Highest param id + 1 a mapping module can expose, used to size per-param tables
+#define MAPPING_MAX_PARAMS 128
+
 struct ParamMapCollection {
 	std::vector<int> parameterIds;
 	bool learningEnabled = false;
@@ -90,23 +93,46 @@ struct ParamMapping {
 };
 
 struct HandleMapCollection : ParamMapCollection {
-	std::map<int, ParamMapping> param2handle; // Key = Multimap's param id
+	static const int MASK_WORDS = (MAPPING_MAX_PARAMS + 31) / 32;
+
+	// Indexed by the mapping module's param id, a slot is in use when its bit
+	// is set in occupied. Sized once, to the params of the module.
+	std::vector<ParamMapping> mappings;
+	uint32_t occupied[MASK_WORDS] = {};
+
+	explicit HandleMapCollection(int capacity) {
+		mappings.resize(clamp(capacity, 0, MAPPING_MAX_PARAMS));
+	}
 
 	virtual ~HandleMapCollection() {
 		clear();
 	}
 
 	void clear() {
-		for (std::pair<int, ParamMapping> element : param2handle) {
-			APP->engine->removeParamHandle(&param2handle[element.first].paramHandle);
+		for(int w = 0; w < MASK_WORDS; w++) {
+			uint32_t bits = occupied[w];
+			while(bits) {
+				int paramId = w * 32 + __builtin_ctz(bits);
+				bits &= bits - 1;
+				APP->engine->removeParamHandle(&mappings[paramId].paramHandle);
+				mappings[paramId] = ParamMapping();
+			}
+			occupied[w] = 0;
+		}
+	}
+
+	bool isEmpty() {
+		for(int w = 0; w < MASK_WORDS; w++) {
+			if(occupied[w]) return false;
 		}
-		param2handle.clear();
+		return true;
 	}
 
 	void unassign(int paramId) override {
 		if(isAssigned(paramId)) {
-			APP->engine->removeParamHandle(&param2handle[paramId].paramHandle);
-			param2handle.erase(paramId);
+			APP->engine->removeParamHandle(&mappings[paramId].paramHandle);
+			mappings[paramId] = ParamMapping();
+			occupied[paramId / 32] &= ~(1u << (paramId % 32));
 		}
 	}
 
@@ -117,7 +143,7 @@ struct HandleMapCollection : ParamMapCollection {
 				unassign(paramId);
 			}
 			else {
-				param2handle[paramId].paramHandle.color = SCHEME_BLUE;
+				mappings[paramId].paramHandle.color = SCHEME_BLUE;
 			}
 		}	
 
@@ -125,27 +151,35 @@ struct HandleMapCollection : ParamMapCollection {
 	}
 
 	bool isDeadParameterHandle(int paramId) {
-		return param2handle[paramId].paramHandle.module == NULL;
+		return mappings[paramId].paramHandle.module == NULL;
 	}
 
 	void untouch() override {
-		if(isAssigned(touchedParamId)) param2handle[touchedParamId].paramHandle.color = SCHEME_YELLOW;
+		if(isAssigned(touchedParamId)) mappings[touchedParamId].paramHandle.color = SCHEME_YELLOW;
 		ParamMapCollection::untouch();
 	}
 
 	bool isAssigned(int paramId) override {
-		return param2handle.find(paramId) != param2handle.end();
+		if(paramId < 0 || paramId >= (int) mappings.size()) return false;
+		return occupied[paramId / 32] & (1u << (paramId % 32));
 	}
 
-	virtual void commitLearn(int paramId, int targetModuleId, int targetParamId) {
-
+	// Returns the slot of paramId, registering its handle with the engine if it's a new one
+	ParamMapping* assign(int paramId) {
+		ParamMapping* mapping = &mappings[paramId];
 		if(! isAssigned(paramId)) {
-			param2handle[paramId] = ParamMapping();
-			param2handle[paramId].paramHandle.color = SCHEME_YELLOW;
-			APP->engine->addParamHandle(&param2handle[paramId].paramHandle);
+			*mapping = ParamMapping();
+			mapping->paramHandle.color = SCHEME_YELLOW;
+			APP->engine->addParamHandle(&mapping->paramHandle);
+			occupied[paramId / 32] |= 1u << (paramId % 32);
 		}
+		return mapping;
+	}
+
+	virtual void commitLearn(int paramId, int targetModuleId, int targetParamId) {
+		if(paramId < 0 || paramId >= (int) mappings.size()) return;
 
-		ParamMapping* mapping = &param2handle[paramId];
+		ParamMapping* mapping = assign(paramId);
 
 		APP->engine->updateParamHandle(&mapping->paramHandle, targetModuleId, targetParamId, true);
 
@@ -159,22 +193,31 @@ struct HandleMapCollection : ParamMapCollection {
 	}
 
 	virtual ParamMapping* getMap(int paramId) {
-		return &param2handle[paramId];
+		return &mappings[paramId];
 	}
 
-	virtual std::map<int, ParamMapping>* getMappedParameters() {
-		return &param2handle;
+	// The collection holding the active mappings
+	virtual HandleMapCollection* getCurrentCollection() {
+		return this;
+	}
+
+	void setHandleColor(NVGcolor color) {
+		for(int w = 0; w < MASK_WORDS; w++) {
+			uint32_t bits = occupied[w];
+			while(bits) {
+				int paramId = w * 32 + __builtin_ctz(bits);
+				bits &= bits - 1;
+				mappings[paramId].paramHandle.color = color;
+			}
+		}
 	}
 
 	json_t* toJson() {
 		json_t* rootJ = json_object();
-		auto iterator = param2handle.begin();
-		while(iterator != param2handle.end())
-		{
-			int key = iterator->first;
-			ParamMapping* mapping = &iterator->second;
-			json_object_set_new(rootJ, std::to_string(key).c_str(), mapping->toJson());
-			iterator++;
+		for(int paramId = 0; paramId < (int) mappings.size(); paramId++) {
+			if(isAssigned(paramId)) {
+				json_object_set_new(rootJ, std::to_string(paramId).c_str(), mappings[paramId].toJson());
+			}
 		}
 
 		return rootJ;
@@ -186,11 +229,9 @@ struct HandleMapCollection : ParamMapCollection {
 
 		json_object_foreach(rootJ, key, value) {
 			int paramId = atoi(key);
-		    param2handle[paramId] = ParamMapping();
-		    ParamMapping* mapping = &param2handle[paramId];
+			if(paramId < 0 || paramId >= (int) mappings.size()) continue;
+			ParamMapping* mapping = assign(paramId);
 			mapping->fromJson(value);
-			mapping->paramHandle.color = SCHEME_YELLOW;
-			APP->engine->addParamHandle(&mapping->paramHandle);
 			APP->engine->updateParamHandle(
 				&mapping->paramHandle, 
 				json_integer_value(json_object_get(value, "module_id")),
@@ -200,10 +241,24 @@ struct HandleMapCollection : ParamMapCollection {
 	}
 };
 
+// Mappings live in the pages, the inherited slots are left empty
 struct MultiHandleMapCollection : HandleMapCollection {
+	// Pages are only allocated once something is mapped in them, NULL otherwise.
+	// Sized once to the maximum page count, as the UI thread walks it while
+	// the engine thread moves between pages.
 	std::vector<HandleMapCollection*> pages;
-	int currentPage;
-	int size;
+	int currentPage = 0;
+	int size = 0;
+	int pageCapacity;
+
+	// Handle colors are repainted from the UI thread, loadPage only flags them
+	std::atomic<bool> colorsDirty {false};
+	int coloredPage = 0; // Page whose handles are currently highlighted
+
+	MultiHandleMapCollection(int pageCapacity_, int maxPages) : HandleMapCollection(0) {
+		pageCapacity = pageCapacity_;
+		pages.resize(maxPages, NULL);
+	}
 
 	~MultiHandleMapCollection() {
 		for(HandleMapCollection* e : pages) {
@@ -212,24 +267,40 @@ struct MultiHandleMapCollection : HandleMapCollection {
 	}
 
 	void clear() {
-		for(HandleMapCollection* e : pages) {
+		for(HandleMapCollection*& e : pages) {
 			delete e;
+			e = NULL;
 		}
-		pages.clear();
 		size = 0;
 	}
 
 	void init(int size_ = 1) {
-		for(int x = 0; x < size_; x++) pages.push_back(new HandleMapCollection());
-		size = size_;
+		size = std::min(size + size_, (int) pages.size());
 		currentPage = 0;
 	}
 
+	// Shared, never written, page returned for banks that have no mapping yet
+	static HandleMapCollection* getEmptyPage() {
+		static HandleMapCollection emptyPage(0);
+		return &emptyPage;
+	}
+
+	HandleMapCollection* getPage(int page) {
+		if(page < 0 || page >= size || ! pages[page]) return getEmptyPage();
+		return pages[page];
+	}
+
+	// NULL past the maximum page count
+	HandleMapCollection* getOrCreatePage(int page) {
+		if(page < 0 || page >= (int) pages.size()) return NULL;
+		if(page >= size) size = page + 1;
+		if(! pages[page]) pages[page] = new HandleMapCollection(pageCapacity);
+		return pages[page];
+	}
+
 	void next() {
-		if(currentPage >= size) {
-			pages.push_back(new HandleMapCollection());
-			size++;
-		}
+		if(currentPage + 1 >= (int) pages.size()) return;
+		if(currentPage + 1 >= size) size++;
 		loadPage(currentPage + 1);
 	}
 
@@ -240,68 +311,81 @@ struct MultiHandleMapCollection : HandleMapCollection {
 	}
 
 	void loadPage(int page) {
-		setCurrentPageHandleColor(nvgRGBA(0xf9, 0xdf, 0x1c, 0x42));
 		currentPage = page;
-		setCurrentPageHandleColor(SCHEME_YELLOW);
+		colorsDirty.store(true, std::memory_order_release);
 	}
 
-	void setCurrentPageHandleColor(NVGcolor color) {
-		HandleMapCollection* parameters = pages[currentPage];
-		auto iterator = parameters->param2handle.begin();
-		while(iterator != parameters->param2handle.end())
-		{
-			iterator->second.paramHandle.color = color;
-			iterator++;
+	// Called from the UI thread, so switching banks doesn't cost a repaint per handle
+	void updateHandleColors() {
+		if(! colorsDirty.exchange(false, std::memory_order_acquire)) return;
+		int page = currentPage;
+		if(coloredPage != page) {
+			getPage(coloredPage)->setHandleColor(nvgRGBA(0xf9, 0xdf, 0x1c, 0x42));
 		}
+		getPage(page)->setHandleColor(SCHEME_YELLOW);
+		coloredPage = page;
+	}
+
+	void setCurrentPageHandleColor(NVGcolor color) {
+		getPage(currentPage)->setHandleColor(color);
 	}
 
 	void unassign(int paramId) override {
-		pages[currentPage]->unassign(paramId);
+		getPage(currentPage)->unassign(paramId);
 	}
 
 	void touch(int paramId) override {
 		untouch();
-		if(pages[currentPage]->isAssigned(paramId)) {
-			if(pages[currentPage]->isDeadParameterHandle(paramId)) {
-				pages[currentPage]->unassign(paramId);
+		HandleMapCollection* page = getPage(currentPage);
+		if(page->isAssigned(paramId)) {
+			if(page->isDeadParameterHandle(paramId)) {
+				page->unassign(paramId);
 			}
 			else {
-				pages[currentPage]->param2handle[paramId].paramHandle.color = SCHEME_BLUE;	
+				page->mappings[paramId].paramHandle.color = SCHEME_BLUE;	
 			}
 		}
 		ParamMapCollection::touch(paramId);
 	}
 
 	void untouch() override {
-		if(pages[currentPage]->isAssigned(touchedParamId)) {
-			pages[currentPage]->param2handle[touchedParamId].paramHandle.color = SCHEME_YELLOW;
+		HandleMapCollection* page = getPage(currentPage);
+		if(page->isAssigned(touchedParamId)) {
+			page->mappings[touchedParamId].paramHandle.color = SCHEME_YELLOW;
 		}
 		ParamMapCollection::untouch();
 	}
 
 	bool isAssigned(int paramId) override {
-		return pages[currentPage]->param2handle.find(paramId) != pages[currentPage]->param2handle.end();
+		return getPage(currentPage)->isAssigned(paramId);
 	}
 
 	void commitLearn(int paramId, int targetModuleId, int targetParamId) override {
-		pages[currentPage]->commitLearn(paramId, targetModuleId, targetParamId);
+		HandleMapCollection* page = getOrCreatePage(currentPage);
+		if(page) page->commitLearn(paramId, targetModuleId, targetParamId);
 		learnNext();
 	}
 
 	ParamMapping* getMap(int paramId) override {
-		return pages[currentPage]->getMap(paramId);
+		return getPage(currentPage)->getMap(paramId);
 	}
 
-	std::map<int, ParamMapping>* getMappedParameters() override {
-		return &pages[currentPage]->param2handle;
+	HandleMapCollection* getCurrentCollection() override {
+		return getPage(currentPage);
 	}
 
 	json_t* toJson() {
 		json_t* rootJ = json_object();
 		json_object_set_new(rootJ, "current_page", json_integer(currentPage));
+
+		// Trailing empty pages are omitted, empty ones in between are stored as null
+		int lastPage = size - 1;
+		while(lastPage >= 0 && getPage(lastPage)->isEmpty()) lastPage--;
+
 		json_t* pagesJ = json_array();
-		for(int x = 0; x < size; x++) {
-			json_array_append_new(pagesJ, pages[x]->toJson());
+		for(int x = 0; x <= lastPage; x++) {
+			HandleMapCollection* page = getPage(x);
+			json_array_append_new(pagesJ, page->isEmpty() ? json_null() : page->toJson());
 		}
 		json_object_set_new(rootJ, "pages", pagesJ);
 		return rootJ;
@@ -312,17 +396,18 @@ struct MultiHandleMapCollection : HandleMapCollection {
 		if(currentPageJ) currentPage = json_integer_value(currentPageJ);
 		json_t* pagesJ = json_object_get(rootJ, "pages");
 		if(pagesJ) {
-			for(HandleMapCollection* e : pages) {
-				delete e;
+			for(int x = 0; x < size; x++) {
+				delete pages[x];
+				pages[x] = NULL;
 			}
-			pages.clear();
-			size = 0;
 			int pSize = json_array_size(pagesJ);
 			for(int x = 0; x < pSize; x++) {
-				pages.push_back(new HandleMapCollection());
-				size++;
-				pages[x]->fromJson(json_array_get(pagesJ, x));
-				loadPage(x);
+				json_t* pageJ = json_array_get(pagesJ, x);
+				if(! json_is_object(pageJ) || json_object_size(pageJ) == 0) continue;
+				HandleMapCollection* page = getOrCreatePage(x);
+				if(! page) break;
+				page->fromJson(pageJ);
+				page->setHandleColor(nvgRGBA(0xf9, 0xdf, 0x1c, 0x42));
 			}
 		}
 		loadPage(currentPage);
@@ -332,13 +417,32 @@ struct MultiHandleMapCollection : HandleMapCollection {
 struct MidiMapping {
 	enum types {
 		MIDI_CC,
-		MIDI_NOTE
+		MIDI_NOTE,
+		MIDI_CC14, // MSB on cc, LSB on cc + 32
+		MIDI_NRPN,
+		MIDI_NRPN14 // Data entry MSB + LSB
 	};
 
 	int port = 0;
 	int type;
 	uint8_t channel;
 	uint8_t cc; // Or note number
+	uint16_t nrpn = 0; // NRPN parameter number
+
+	bool isHighResolution() {
+		return type == MIDI_CC14 || type == MIDI_NRPN14;
+	}
+
+	bool isNrpn() {
+		return type == MIDI_NRPN || type == MIDI_NRPN14;
+	}
+
+	std::string getLabel() {
+		std::string channelStr = std::to_string(channel + 1);
+		if(isNrpn()) return channelStr + "/N" + std::to_string(nrpn);
+		if(type == MIDI_CC14) return channelStr + "/" + std::to_string(cc) + "+";
+		return channelStr + "/" + std::to_string(cc);
+	}
 
 	json_t* toJson() {
 		json_t* rootJ = json_object();
@@ -346,6 +450,7 @@ struct MidiMapping {
 		json_object_set_new(rootJ, "type", json_integer(type));
 		json_object_set_new(rootJ, "channel", json_integer(channel));
 		json_object_set_new(rootJ, "cc", json_integer(cc));
+		if(isNrpn()) json_object_set_new(rootJ, "nrpn", json_integer(nrpn));
 		return rootJ;
 	}
 
@@ -358,61 +463,261 @@ struct MidiMapping {
 		if(channelJ) channel = (uint8_t) json_integer_value(channelJ);
 		json_t* ccJ = json_object_get(rootJ, "cc");
 		if(ccJ) cc = (uint8_t) json_integer_value(ccJ);
+		json_t* nrpnJ = json_object_get(rootJ, "nrpn");
+		if(nrpnJ) nrpn = (uint16_t) json_integer_value(nrpnJ);
 	}
 };
 
 struct MidiMapCollection : ParamMapCollection {
+	static const int MIDI_TYPES = 3; // CC, Note & 14 bit CC are indexed by number
+	static const int MIDI_CHANNELS = 16;
+	static const int MIDI_NUMBERS = 128;
+
+	// Controller numbers used by the (N)RPN protocol
+	static const uint8_t CC_DATA_ENTRY_MSB = 6;
+	static const uint8_t CC_DATA_ENTRY_LSB = 38;
+	static const uint8_t CC_NRPN_LSB = 98;
+	static const uint8_t CC_NRPN_MSB = 99;
+	static const uint8_t CC_RPN_LSB = 100;
+	static const uint8_t CC_RPN_MSB = 101;
+
 	std::map<int,MidiMapping> param2midi; // ParamID -> Midi Mapping
 
+	struct NrpnEntry {
+		int key; // Channel * 16384 + NRPN number
+		int paramId;
+		bool highResolution;
+	};
+
+	// Reverse index of param2midi, so incoming messages are resolved without
+	// scanning the whole map. Must be rebuilt each time param2midi changes.
+	int midi2param[MIDI_TYPES][MIDI_CHANNELS][MIDI_NUMBERS]; // Type -> Channel -> CC/Note -> ParamID
+	NrpnEntry nrpn2param[MAPPING_MAX_PARAMS]; // Sorted by key
+	int nrpnCount = 0;
+
+	// Incremented each time the mappings change, so consumers can refresh their own copies
+	uint32_t generation = 0;
+
+	// Running state of 14 bit controllers, per channel
+	uint8_t ccMsb[MIDI_CHANNELS][32] = {};
+	uint8_t ccLsb[MIDI_CHANNELS][32] = {};
+	int nrpnNumber[MIDI_CHANNELS]; // Selected NRPN number, -1 if none
+	int nrpnParamId[MIDI_CHANNELS]; // Param mapped to the selected NRPN number
+	bool nrpnHighResolution[MIDI_CHANNELS]; // Whether that param is mapped to a 14 bit NRPN
+	uint8_t nrpnMsb[MIDI_CHANNELS] = {};
+	uint8_t nrpnLsb[MIDI_CHANNELS] = {};
+
+	// Last learnt mapping that may be upgraded to 14 bit if the expected LSB follows
+	int pairParamId = -1;
+	uint8_t pairChannel = 0;
+	uint8_t pairNumber = 0;
+
+	MidiMapCollection() {
+		for(int c = 0; c < MIDI_CHANNELS; c++) {
+			nrpnNumber[c] = -1;
+			nrpnHighResolution[c] = false;
+		}
+		updateLookup();
+	}
+
 	void clear() {
 		param2midi.clear();
+		updateLookup();
 	}
 
 	void unassign(int paramId) override {
 		param2midi.erase(paramId);
+		updateLookup();
 	}
 
 	bool isAssigned(int paramId) override {
 		return param2midi.find(paramId) != param2midi.end();
 	}
 
+	void updateLookup() {
+		generation++;
+		std::fill(&midi2param[0][0][0], &midi2param[0][0][0] + MIDI_TYPES * MIDI_CHANNELS * MIDI_NUMBERS, -1);
+		nrpnCount = 0;
+
+		auto iterator = param2midi.begin();
+		while(iterator != param2midi.end())
+		{
+			MidiMapping* mapping = &iterator->second;
+			if(mapping->isNrpn()) {
+				if(mapping->channel < MIDI_CHANNELS && nrpnCount < MAPPING_MAX_PARAMS) {
+					NrpnEntry entry = {mapping->channel * 16384 + mapping->nrpn, iterator->first, mapping->type == MidiMapping::MIDI_NRPN14};
+					nrpn2param[nrpnCount++] = entry;
+				}
+			}
+			else if(mapping->type >= 0 && mapping->type < MIDI_TYPES && mapping->channel < MIDI_CHANNELS && mapping->cc < MIDI_NUMBERS) {
+				// Keep the lowest param id when several params share the same message
+				int* paramId = &midi2param[mapping->type][mapping->channel][mapping->cc];
+				if(*paramId == -1) *paramId = iterator->first;
+			}
+			iterator++;
+		}
+
+		// Lowest param id first when several params share the same number.
+		// Learning runs on the engine thread, std::sort doesn't allocate.
+		std::sort(nrpn2param, nrpn2param + nrpnCount, [](const NrpnEntry& a, const NrpnEntry& b) {
+			return a.key < b.key || (a.key == b.key && a.paramId < b.paramId);
+		});
+
+		for(int c = 0; c < MIDI_CHANNELS; c++) {
+			selectNrpn(c, nrpnNumber[c]);
+		}
+	}
+
+	const NrpnEntry* findNrpn(uint8_t channel, int number) {
+		if(number < 0) return NULL;
+		NrpnEntry key = {channel * 16384 + number, -1, false};
+		const NrpnEntry* entry = std::lower_bound(nrpn2param, nrpn2param + nrpnCount, key, [](const NrpnEntry& a, const NrpnEntry& b) {
+			return a.key < b.key;
+		});
+		return entry != nrpn2param + nrpnCount && entry->key == key.key ? entry : NULL;
+	}
+
+	void selectNrpn(uint8_t channel, int number) {
+		const NrpnEntry* entry = findNrpn(channel, number);
+		nrpnNumber[channel] = number;
+		nrpnParamId[channel] = entry ? entry->paramId : -1;
+		nrpnHighResolution[channel] = entry && entry->highResolution;
+	}
+
 	int getMappedParamId(midi::Message& msg) {
 		uint8_t channel = msg.getChannel();
 		uint8_t number = msg.getNote();
-		int type;
+		if(number >= MIDI_NUMBERS) return -1;
 
 		switch (msg.getStatus()) {	
 			case 0x9:
-				type = MidiMapping::MIDI_NOTE;
-				break;
+				return midi2param[MidiMapping::MIDI_NOTE][channel][number];
 			case 0xb:
-				type = MidiMapping::MIDI_CC;
-				break;
+				if(midi2param[MidiMapping::MIDI_CC][channel][number] > -1) {
+					return midi2param[MidiMapping::MIDI_CC][channel][number];
+				}
+				if(isDataEntry(channel, number)) {
+					return nrpnParamId[channel];
+				}
+				if(number < 32) {
+					return midi2param[MidiMapping::MIDI_CC14][channel][number];
+				}
 		}
 
-		auto iterator = param2midi.begin();
+		return -1;
+	}
 
-		while(iterator != param2midi.end())
-		{
-			MidiMapping* mapping = &iterator->second;
-			if(mapping->type == type && mapping->channel == channel && mapping->cc == number) {
-				return iterator->first;
-			}
-			iterator++;
+	/**
+	 * Resolve an incoming message to its mapped parameter, updating the state
+	 * of 14 bit controllers on the way. value is set on 0-127 or on 0-16383
+	 * when highResolution is true. Returns -1 if the message isn't mapped.
+	 */
+	int resolve(midi::Message& msg, int* value, bool* highResolution) {
+		uint8_t channel = msg.getChannel();
+		uint8_t number = msg.getNote();
+		if(number >= MIDI_NUMBERS) return -1;
+
+		uint8_t status = msg.getStatus();
+		if(status == 0x9) {
+			*value = msg.getValue();
+			*highResolution = false;
+			return midi2param[MidiMapping::MIDI_NOTE][channel][number];
+		}
+		if(status != 0xb) return -1;
+
+		// Plain 7 bit CC have the priority, so this path costs the same as before
+		int paramId = midi2param[MidiMapping::MIDI_CC][channel][number];
+		if(paramId > -1) {
+			*value = msg.getValue();
+			*highResolution = false;
+			return paramId;
+		}
+
+		return resolveHighResolution(channel, number, msg.getValue(), value, highResolution);
+	}
+
+	// Data entry controllers belong to the NRPN selected on their channel, as
+	// when learning. Without one they are plain 14 bit CC.
+	bool isDataEntry(uint8_t channel, uint8_t number) {
+		return (number == CC_DATA_ENTRY_MSB || number == CC_DATA_ENTRY_LSB) && nrpnNumber[channel] > -1;
+	}
+
+	int resolveHighResolution(uint8_t channel, uint8_t number, uint8_t data, int* value, bool* highResolution) {
+		*highResolution = true;
+
+		if(isDataEntry(channel, number)) {
+			return resolveDataEntry(channel, number, data, value, highResolution);
+		}
+		if(number < 32) {
+			// A new MSB starts a new value, don't pair it with the previous LSB
+			ccMsb[channel][number] = data;
+			ccLsb[channel][number] = 0;
+			*value = data << 7;
+			return midi2param[MidiMapping::MIDI_CC14][channel][number];
+		}
+		if(number < 64) {
+			ccLsb[channel][number - 32] = data;
+			*value = (ccMsb[channel][number - 32] << 7) | data;
+			return midi2param[MidiMapping::MIDI_CC14][channel][number - 32];
+		}
+
+		switch(number) {
+			case CC_NRPN_MSB:
+				selectNrpn(channel, (data << 7) | (nrpnNumber[channel] > -1 ? nrpnNumber[channel] & 0x7f : 0));
+				return -1;
+			case CC_NRPN_LSB:
+				selectNrpn(channel, (nrpnNumber[channel] > -1 ? nrpnNumber[channel] & 0x3f80 : 0) | data);
+				return -1;
+			case CC_RPN_MSB:
+			case CC_RPN_LSB:
+				selectNrpn(channel, -1);
+				return -1;
 		}
 
 		return -1;
 	}
 
+	int resolveDataEntry(uint8_t channel, uint8_t number, uint8_t data, int* value, bool* highResolution) {
+		if(number == CC_DATA_ENTRY_MSB) {
+			nrpnMsb[channel] = data;
+			nrpnLsb[channel] = 0;
+		}
+		else {
+			nrpnLsb[channel] = data;
+		}
+		int paramId = nrpnParamId[channel];
+		if(paramId < 0) return -1;
+		if(nrpnHighResolution[channel]) {
+			*value = (nrpnMsb[channel] << 7) | nrpnLsb[channel];
+		}
+		else {
+			// 7 bit NRPN only listen to the data entry MSB
+			if(number == CC_DATA_ENTRY_LSB) return -1;
+			*value = data;
+			*highResolution = false;
+		}
+		return paramId;
+	}
+
 	void onMidiMessage(midi::Message& msg) {
+		if(msg.getStatus() == 0xb && pairParamId > -1 && tryUpgradeToHighResolution(msg)) {
+			return;
+		}
+
 		if(isLearningEnabled() && learningParamId > -1) {
+			uint8_t channel = msg.getChannel();
+			uint8_t number = msg.getNote();
+
+			// NRPN number selection isn't learnt, only the following data entry
+			if(msg.getStatus() == 0xb && (number == CC_NRPN_MSB || number == CC_NRPN_LSB || number == CC_RPN_MSB || number == CC_RPN_LSB)) {
+				return;
+			}
+
 			int assignedParamId = getMappedParamId(msg);
 			if(assignedParamId > -1) {
 				unassign(assignedParamId);
 			}
 
-			uint8_t channel = msg.getChannel();
-			uint8_t number = msg.getNote();
 			// Allow mapping CC & Notes
 			switch (msg.getStatus()) {
 				// NOTE ON
@@ -435,17 +740,46 @@ struct MidiMapCollection : ParamMapCollection {
 					mapping.channel = channel;
 					mapping.cc = number;
 					mapping.type = MidiMapping::MIDI_CC;
+					if(number == CC_DATA_ENTRY_MSB && nrpnNumber[channel] > -1) {
+						mapping.type = MidiMapping::MIDI_NRPN;
+						mapping.nrpn = nrpnNumber[channel];
+					}
 					if(isAssigned(learningParamId)) {
 						param2midi.erase(learningParamId);		
 					}
 					param2midi.emplace(learningParamId, mapping);
+
+					// Wait for a possible LSB to turn this into a 14 bit mapping
+					if(mapping.type == MidiMapping::MIDI_NRPN || number < 32) {
+						pairParamId = learningParamId;
+						pairChannel = channel;
+						pairNumber = mapping.type == MidiMapping::MIDI_NRPN ? CC_DATA_ENTRY_LSB : number + 32;
+					}
 					commitLearn();
 					break;
 			}
+
+			updateLookup();
 		}
 		
 	}
 
+	// Called with the message following a learnt CC. Returns true if it was
+	// the LSB of the learnt controller.
+	bool tryUpgradeToHighResolution(midi::Message& msg) {
+		int paramId = pairParamId;
+		pairParamId = -1;
+
+		if(msg.getChannel() != pairChannel || msg.getNote() != pairNumber || ! isAssigned(paramId)) {
+			return false;
+		}
+
+		MidiMapping* mapping = &param2midi[paramId];
+		mapping->type = mapping->type == MidiMapping::MIDI_NRPN ? MidiMapping::MIDI_NRPN14 : MidiMapping::MIDI_CC14;
+		updateLookup();
+		return true;
+	}
+
 	void commitLearn() {
 		learningParamId = -1;
 	}
@@ -482,22 +816,42 @@ struct MidiMapCollection : ParamMapCollection {
 			mapping.fromJson(value);
 			param2midi.emplace(paramId, mapping);
 		}
+
+		updateLookup();
 	}
 };
 
 struct MidiFeedbackCache {
-	std::map<int,uint8_t> values;
+	uint16_t values[MAPPING_MAX_PARAMS] = {}; // 7 or 14 bit values
 
-	void updateCache(int paramId, uint8_t value) {
+	void updateCache(int paramId, uint16_t value) {
 		values[paramId] = value;
 	}
 
-	bool changed(int paramId, uint8_t value) {
+	bool changed(int paramId, uint16_t value) {
 		return values[paramId] != value;
 	}
 };
 
 struct MappingProcessor {
+	static const int MAX_SCHEDULED_VALUES = 256;
+
+	struct ScheduledValue {
+		int paramId;
+		uint16_t value;
+		bool highResolution;
+		int64_t frame;
+	};
+
+	// Flat copy of the MIDI mappings, walked by the feedback loop
+	struct FeedbackSlot {
+		int paramId;
+		MidiMapping mapping;
+		ParamQuantity* paramQuantity;
+		Param* param;
+		float lastValue;
+	};
+
 	MidiInputOutput* midiIO = NULL;
 	MidiMapCollection* midiMap = NULL;
 	HandleMapCollection* handleMap = NULL;
@@ -507,18 +861,53 @@ struct MappingProcessor {
 	MidiFeedbackCache midiCache;
 	std::map<int,ParamQuantity*> params;
 
+	FeedbackSlot feedbackSlots[MAPPING_MAX_PARAMS];
+	int feedbackSlotCount = 0;
+	uint32_t feedbackGeneration = 0;
+
 	float scaledValues[128];
 
 	bool processMidiInput = true;
 
+	// When enabled, MIDI values are applied at the sample they were received,
+	// delayed by one divider period, instead of all at once on divider ticks.
+	bool sampleAccurate = false;
+	// Mode requested from the UI thread, applied by process() : -1 when
+	// there's no request, 0 or 1 otherwise
+	std::atomic<int> pendingSampleAccurate;
+	int64_t frame = 0;
+	ScheduledValue scheduledValues[MAX_SCHEDULED_VALUES];
+	int scheduledStart = 0;
+	int scheduledCount = 0;
+
+	// Time in seconds to sweep the whole range of a parameter, 0 = no smoothing
+	float slewTime = 0.f;
+	float sampleTime = 1.f / 44100.f;
+	float slewTargets[MAPPING_MAX_PARAMS];
+	ParamQuantity* slewQuantities[MAPPING_MAX_PARAMS];
+	bool slewing[MAPPING_MAX_PARAMS] = {};
+	int slewingIds[MAPPING_MAX_PARAMS];
+	int slewingCount = 0;
+
 	MappingProcessor() {
 		for(int x = 0; x < 128; x++) {
 			scaledValues[x] = (1.f / 127) * x;
 		}
 		divider.setDivision(32);
+		pendingSampleAccurate = -1;
 	}
 
 	void process() {
+		if(pendingSampleAccurate.load(std::memory_order_relaxed) > -1) {
+			applySampleAccurate(pendingSampleAccurate.exchange(-1) == 1);
+		}
+		if(sampleAccurate) {
+			frame++;
+			if(midiIO) midiIO->input.frame.store(frame, std::memory_order_relaxed);
+			if(scheduledCount > 0) processScheduledValues();
+		}
+		if(slewingCount > 0) processSlews();
+
 		if(divider.process()) {
 			if(midiIO && midiMap && processMidiInput && midiIO->input.isConnected()) processMidiQueue();
 			if(handleMap) processHandledParameters();
@@ -526,37 +915,153 @@ struct MappingProcessor {
 		}
 	}
 
-	void processMidiQueue() {
-		bool learning = midiMap->isLearningEnabled() && midiMap->learningParamId > -1;
+	void setSampleRate(float sampleRate) {
+		sampleTime = 1.f / sampleRate;
+	}
+
+	/**
+	 * Called from the UI thread, the mode changes on the next sample
+	 */
+	void setSampleAccurate(bool enabled) {
+		pendingSampleAccurate = enabled ? 1 : 0;
+	}
+
+	// Mode as the UI sees it, including a change not applied yet
+	bool isSampleAccurate() {
+		int pending = pendingSampleAccurate;
+		return pending > -1 ? pending == 1 : sampleAccurate;
+	}
 
+	void applySampleAccurate(bool enabled) {
+		// Flush pending values so nothing is lost when switching modes
+		while(scheduledCount > 0) {
+			ScheduledValue* scheduled = &scheduledValues[scheduledStart];
+			applyValue(scheduled->paramId, scheduled->value, scheduled->highResolution);
+			scheduledStart = (scheduledStart + 1) % MAX_SCHEDULED_VALUES;
+			scheduledCount--;
+		}
+		sampleAccurate = enabled;
+	}
+
+	void processMidiQueue() {
 		// Scan midi input and update params & button states
 		midi::Message msg;
-		while (midiIO->input.shift(&msg)) {
+		int64_t msgFrame;
+		while (midiIO->input.shift(&msg, &msgFrame)) {
 
-			if (learning == true) {
+			// Checked per message, a learnt CC may still be upgraded to 14 bit by the next one
+			if (midiMap->isLearningEnabled()) {
 				midiMap->onMidiMessage(msg);
 			}
 
-			int paramId = midiMap->getMappedParamId(msg);
+			int midiValue;
+			bool highResolution;
+			int paramId = midiMap->resolve(msg, &midiValue, &highResolution);
 			
 			if(paramId > -1) {
-				uint8_t midiValue = msg.getValue();
-				params[paramId]->setScaledValue(scaledValues[midiValue]);
-				midiCache.updateCache(paramId, midiValue);
+				if(sampleAccurate) {
+					scheduleValue(paramId, midiValue, highResolution, msgFrame + divider.getDivision());
+				}
+				else {
+					applyValue(paramId, midiValue, highResolution);
+				}
 				midiMap->touch(paramId);
 			}
 		}
 	}
 
-	void processHandledParameters() {
-		std::map<int,ParamMapping>* parameters = handleMap->getMappedParameters();
+	void scheduleValue(int paramId, uint16_t value, bool highResolution, int64_t valueFrame) {
+		if(scheduledCount == MAX_SCHEDULED_VALUES) {
+			applyValue(paramId, value, highResolution);
+			return;
+		}
+		int index = (scheduledStart + scheduledCount) % MAX_SCHEDULED_VALUES;
+		scheduledValues[index].paramId = paramId;
+		scheduledValues[index].value = value;
+		scheduledValues[index].highResolution = highResolution;
+		scheduledValues[index].frame = valueFrame;
+		scheduledCount++;
+	}
+
+	// Messages are queued in reception order, so only the head needs to be checked
+	void processScheduledValues() {
+		while(scheduledCount > 0 && scheduledValues[scheduledStart].frame <= frame) {
+			ScheduledValue* scheduled = &scheduledValues[scheduledStart];
+			applyValue(scheduled->paramId, scheduled->value, scheduled->highResolution);
+			scheduledStart = (scheduledStart + 1) % MAX_SCHEDULED_VALUES;
+			scheduledCount--;
+		}
+	}
 
-		auto iterator = parameters->begin();
-		while(iterator != parameters->end())
-		{
-			int paramId = iterator->first;
-			updateHandledParameter(paramId, &iterator->second);
-			iterator++;
+	void applyValue(int paramId, uint16_t midiValue, bool highResolution = false) {
+		// 14 bit values are scaled on the fly, a lookup table would take 64KB
+		float value = highResolution ? midiValue * (1.f / 16383) : scaledValues[midiValue];
+		if(slewTime > 0.f && paramId < MAPPING_MAX_PARAMS) {
+			startSlew(paramId, value);
+		}
+		else {
+			params[paramId]->setScaledValue(value);
+		}
+		midiCache.updateCache(paramId, midiValue);
+	}
+
+	void startSlew(int paramId, float target) {
+		slewTargets[paramId] = target;
+		if(! slewing[paramId]) {
+			slewQuantities[paramId] = params[paramId];
+			slewing[paramId] = true;
+			slewingIds[slewingCount] = paramId;
+			slewingCount++;
+		}
+	}
+
+	void processSlews() {
+		float step = sampleTime / slewTime;
+		int x = 0;
+		while(x < slewingCount) {
+			int paramId = slewingIds[x];
+			ParamQuantity* paramQuantity = slewQuantities[paramId];
+			float target = slewTargets[paramId];
+			float value = paramQuantity->getScaledValue();
+
+			if(std::fabs(target - value) <= step || slewTime <= 0.f) {
+				paramQuantity->setScaledValue(target);
+				slewing[paramId] = false;
+				slewingCount--;
+				slewingIds[x] = slewingIds[slewingCount];
+			}
+			else {
+				paramQuantity->setScaledValue(value < target ? value + step : value - step);
+				x++;
+			}
+		}
+	}
+
+	json_t* toJson() {
+		json_t* rootJ = json_object();
+		json_object_set_new(rootJ, "sample_accurate", json_boolean(isSampleAccurate()));
+		json_object_set_new(rootJ, "slew_time", json_real(slewTime));
+		return rootJ;
+	}
+
+	void fromJson(json_t* rootJ) {
+		json_t* sampleAccurateJ = json_object_get(rootJ, "sample_accurate");
+		if(sampleAccurateJ) setSampleAccurate(json_is_true(sampleAccurateJ));
+		json_t* slewTimeJ = json_object_get(rootJ, "slew_time");
+		if(slewTimeJ) slewTime = json_real_value(slewTimeJ);
+	}
+
+	void processHandledParameters() {
+		HandleMapCollection* collection = handleMap->getCurrentCollection();
+
+		// Walk the occupancy mask so only assigned slots are visited
+		for(int w = 0; w < HandleMapCollection::MASK_WORDS; w++) {
+			uint32_t bits = collection->occupied[w];
+			while(bits) {
+				int paramId = w * 32 + __builtin_ctz(bits);
+				bits &= bits - 1;
+				updateHandledParameter(paramId, &collection->mappings[paramId]);
+			}
 		}
 	}
 
@@ -592,33 +1097,94 @@ struct MappingProcessor {
 	}
 
 
-	void processMidiFeedback() {
-		std::map<int, MidiMapping>* mappings = midiMap->getMappedParameters();
+	void updateFeedbackSlots() {
+		feedbackSlotCount = 0;
 
+		std::map<int, MidiMapping>* mappings = midiMap->getMappedParameters();
 		auto iterator = mappings->begin();
-		while(iterator != mappings->end())
+		while(iterator != mappings->end() && feedbackSlotCount < MAPPING_MAX_PARAMS)
 		{
 			int paramId = iterator->first;
-			MidiMapping midiMapping = iterator->second;
-			
-			float value = params[paramId]->getScaledValue();
+			ParamQuantity* paramQuantity = params[paramId];
+			if(paramId < MAPPING_MAX_PARAMS && paramQuantity) {
+				FeedbackSlot* slot = &feedbackSlots[feedbackSlotCount];
+				slot->paramId = paramId;
+				slot->mapping = iterator->second;
+				slot->paramQuantity = paramQuantity;
+				slot->param = &paramQuantity->module->params[paramQuantity->paramId];
+				slot->lastValue = NAN; // Force a first check
+				feedbackSlotCount++;
+			}
+			iterator++;
+		}
+
+		feedbackGeneration = midiMap->generation;
+	}
+
+	void processMidiFeedback() {
+		if(feedbackGeneration != midiMap->generation) updateFeedbackSlots();
 
-			uint8_t midiValue = (uint8_t) floor(value * 127);
+		for(int x = 0; x < feedbackSlotCount; x++) {
+			FeedbackSlot* slot = &feedbackSlots[x];
+			int paramId = slot->paramId;
+
+			// Dirty check on the raw value, so untouched params cost a single compare
+			float rawValue = slot->param->getValue();
+			if(rawValue == slot->lastValue) continue;
+
+			// Don't echo intermediate values back while smoothing an incoming change
+			if(slewing[paramId]) continue;
+
+			slot->lastValue = rawValue;
+
+			float value = slot->paramQuantity->getScaledValue();
+
+			MidiMapping* midiMapping = &slot->mapping;
+			bool highResolution = midiMapping->isHighResolution();
+			uint16_t midiValue = (uint16_t) floor(value * (highResolution ? 16383 : 127));
 
 			if(midiCache.changed(paramId, midiValue)) {
-				midi::Message m;
-				if(midiMapping.type == MidiMapping::MIDI_CC) m.setStatus(0xb);
-				if(midiMapping.type == MidiMapping::MIDI_NOTE) m.setStatus(0x9);
-				m.setChannel(midiMapping.channel);
-				m.setNote(midiMapping.cc);
-				m.setValue(midiValue);
-				midiIO->output.sendRawMessage(m);
+				sendFeedback(midiMapping, midiValue);
 				midiCache.updateCache(paramId, midiValue);
 			}
+		}
+	}
 
-			iterator++;
+	void sendFeedback(MidiMapping* midiMapping, uint16_t midiValue) {
+		switch(midiMapping->type) {
+			case MidiMapping::MIDI_CC:
+				sendFeedbackMessage(0xb, midiMapping->channel, midiMapping->cc, midiValue);
+				break;
+			case MidiMapping::MIDI_NOTE:
+				sendFeedbackMessage(0x9, midiMapping->channel, midiMapping->cc, midiValue);
+				break;
+			case MidiMapping::MIDI_CC14:
+				sendFeedbackMessage(0xb, midiMapping->channel, midiMapping->cc, midiValue >> 7);
+				sendFeedbackMessage(0xb, midiMapping->channel, midiMapping->cc + 32, midiValue & 0x7f);
+				break;
+			case MidiMapping::MIDI_NRPN:
+			case MidiMapping::MIDI_NRPN14:
+				sendFeedbackMessage(0xb, midiMapping->channel, MidiMapCollection::CC_NRPN_MSB, midiMapping->nrpn >> 7);
+				sendFeedbackMessage(0xb, midiMapping->channel, MidiMapCollection::CC_NRPN_LSB, midiMapping->nrpn & 0x7f);
+				if(midiMapping->type == MidiMapping::MIDI_NRPN) {
+					sendFeedbackMessage(0xb, midiMapping->channel, MidiMapCollection::CC_DATA_ENTRY_MSB, midiValue);
+				}
+				else {
+					sendFeedbackMessage(0xb, midiMapping->channel, MidiMapCollection::CC_DATA_ENTRY_MSB, midiValue >> 7);
+					sendFeedbackMessage(0xb, midiMapping->channel, MidiMapCollection::CC_DATA_ENTRY_LSB, midiValue & 0x7f);
+				}
+				break;
 		}
 	}
+
+	void sendFeedbackMessage(uint8_t status, uint8_t channel, uint8_t number, uint8_t value) {
+		midi::Message m;
+		m.setStatus(status);
+		m.setChannel(channel);
+		m.setNote(number);
+		m.setValue(value);
+		midiIO->output.sendRawMessage(m);
+	}
 };
 
 struct ParamMapButton : OpaqueWidget {
@@ -660,6 +1226,56 @@ struct ParamMapButton : OpaqueWidget {
 	}
 };
 
+struct SampleAccurateItem : MenuItem {
+	MappingProcessor* mappingProcessor;
+
+	void onAction(const event::Action& e) override {
+		mappingProcessor->setSampleAccurate(! mappingProcessor->isSampleAccurate());
+	}
+};
+
+struct MidiSmoothingValueItem : MenuItem {
+	MappingProcessor* mappingProcessor;
+	float slewTime;
+
+	void onAction(const event::Action& e) override {
+		mappingProcessor->slewTime = slewTime;
+	}
+};
+
+struct MidiSmoothingItem : MenuItem {
+	MappingProcessor* mappingProcessor;
+
+	Menu* createChildMenu() override {
+		Menu* menu = new Menu;
+		const float slewTimes[5] = {0.f, 0.01f, 0.05f, 0.1f, 0.25f};
+		for(int x = 0; x < 5; x++) {
+			MidiSmoothingValueItem* item = new MidiSmoothingValueItem;
+			item->mappingProcessor = mappingProcessor;
+			item->slewTime = slewTimes[x];
+			item->text = slewTimes[x] > 0.f ? std::to_string((int) (slewTimes[x] * 1000)) + " ms" : "Off";
+			item->rightText = CHECKMARK(mappingProcessor->slewTime == slewTimes[x]);
+			menu->addChild(item);
+		}
+		return menu;
+	}
+};
+
+struct MappingMenuBuilder {
+	void build(Menu* menu, MappingProcessor* mappingProcessor) {
+		{
+			SampleAccurateItem* item = createMenuItem<SampleAccurateItem>("Sample accurate MIDI input", CHECKMARK(mappingProcessor->isSampleAccurate()));
+			item->mappingProcessor = mappingProcessor;
+			menu->addChild(item);
+		}
+		{
+			MidiSmoothingItem* item = createMenuItem<MidiSmoothingItem>("MIDI input smoothing", RIGHT_ARROW);
+			item->mappingProcessor = mappingProcessor;
+			menu->addChild(item);
+		}
+	}
+};
+
 template <typename TBase = KnobWhite32>
 struct MappableParameter : TBase {
 	using TBase::box;
@@ -722,9 +1338,7 @@ struct MappableParameter : TBase {
 
 		if(midiMap) {
 			if(midiMap->isLearningEnabled() && midiMap->isAssigned(paramId)) {
-				uint8_t cc = midiMap->param2midi[paramId].cc;
-				uint8_t channel = midiMap->param2midi[paramId].channel + 1;
-				std::string assignText = std::to_string(channel) + "/" + std::to_string(cc);
+				std::string assignText = midiMap->param2midi[paramId].getLabel();
 				midiLabel->setText(assignText);
 				midiLabel->visible = true;
 			}
@@ -1,5 +1,174 @@
 #include "midi.hpp"
 
+// Single thread draining the schedulers of every MIDI output
+struct MidiOutputWorker {
+	std::mutex mutex;
+	std::vector<MidiOutputScheduler*> schedulers;
+	std::thread thread;
+	// Incremented to ask the running thread to stop
+	std::atomic<int> generation;
+
+	MidiOutputWorker() {
+		generation = 0;
+	}
+
+	void add(MidiOutputScheduler* scheduler) {
+		std::lock_guard<std::mutex> lock(mutex);
+		schedulers.push_back(scheduler);
+		if(! thread.joinable()) {
+			thread = std::thread(&MidiOutputWorker::run, this, generation.load());
+		}
+	}
+
+	void remove(MidiOutputScheduler* scheduler) {
+		std::thread stoppedThread;
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			schedulers.erase(std::remove(schedulers.begin(), schedulers.end(), scheduler), schedulers.end());
+			if(schedulers.empty() && thread.joinable()) {
+				generation++;
+				stoppedThread = std::move(thread);
+			}
+		}
+		if(stoppedThread.joinable()) stoppedThread.join();
+	}
+
+	void run(int threadGeneration) {
+		auto lastTime = std::chrono::steady_clock::now();
+		while(generation == threadGeneration) {
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+			auto now = std::chrono::steady_clock::now();
+			float elapsed = std::chrono::duration<float>(now - lastTime).count();
+			lastTime = now;
+
+			std::lock_guard<std::mutex> lock(mutex);
+			for(MidiOutputScheduler* scheduler : schedulers) {
+				scheduler->process(elapsed);
+			}
+		}
+	}
+};
+
+static MidiOutputWorker midiOutputWorker;
+
+MidiOutputScheduler::~MidiOutputScheduler() {
+	setActive(false);
+}
+
+// Outputs without a device don't wake the worker
+void MidiOutputScheduler::setActive(bool active) {
+	if(active == registered) return;
+	registered = active;
+	if(active) midiOutputWorker.add(this);
+	else midiOutputWorker.remove(this);
+}
+
+// The worker may be sending to the current device, it's left out until the
+// new one is open
+void MidiOutput::setDeviceId(int deviceId) {
+	scheduler.setActive(false);
+	{
+		std::lock_guard<std::mutex> lock(midiOutputWorker.mutex);
+		rack::midi::Output::setDeviceId(deviceId);
+	}
+	scheduler.setActive(deviceId > -1);
+}
+
+// (N)RPN selection & data entry controllers only make sense as an ordered
+// sequence, they can't be merged with other values
+static bool isSequencedController(uint8_t cc) {
+	return cc == 6 || cc == 38 || (cc >= 98 && cc <= 101);
+}
+
+// Parameter number MSB & LSB then data entry MSB & LSB
+static const int MAX_SEQUENCE_LENGTH = 4;
+
+// Whether a message fits in a queue with room free places. (N)RPN sequences
+// go through whole or not at all : room for the longest one is required
+// when a sequence starts, the rest of it shares the fate of its start.
+static bool acceptMessage(rack::midi::Message &message, int room, bool* droppedSequences) {
+	if(message.getStatus() == 0xb && isSequencedController(message.getNote())) {
+		int channel = message.getChannel();
+		uint8_t cc = message.getNote();
+		if(cc == 99 || cc == 101) droppedSequences[channel] = room < MAX_SEQUENCE_LENGTH;
+		if(droppedSequences[channel]) return false;
+	}
+	return room > 0;
+}
+
+void MidiOutputScheduler::push(rack::midi::Message &message) {
+	if(! registered.load(std::memory_order_relaxed)) return;
+	if(acceptMessage(message, queue.capacity(), droppedPushedSequences)) {
+		queue.push(message);
+	}
+}
+
+void MidiOutputScheduler::coalesce(rack::midi::Message &message) {
+	if(message.getStatus() == 0xb && ! isSequencedController(message.getNote())) {
+		int key = message.getChannel() * 128 + (message.getNote() & 0x7f);
+		if(pendingValues[key] < 0) {
+			pendingOrder[(pendingStart + pendingCount) % CC_KEYS] = key;
+			pendingCount++;
+		}
+		pendingValues[key] = message.getValue();
+	}
+	else if(acceptMessage(message, QUEUE_SIZE - otherCount, droppedCoalescedSequences)) {
+		otherMessages[(otherStart + otherCount) % QUEUE_SIZE] = message;
+		otherCount++;
+	}
+}
+
+void MidiOutputScheduler::process(float elapsed) {
+	while(! queue.empty()) {
+		rack::midi::Message message = queue.shift();
+		coalesce(message);
+	}
+
+	int rate = messagesPerSecond;
+	if(rate > 0) {
+		// Allow a burst of 10ms worth of messages
+		float maxTokens = std::max(1.f, rate * 0.01f);
+		tokens = std::min(tokens + elapsed * rate, maxTokens);
+	}
+
+	while((otherCount > 0 || pendingCount > 0) && (rate <= 0 || tokens >= 1.f)) {
+		rack::midi::Message message;
+		if(otherCount > 0) {
+			message = otherMessages[otherStart];
+			otherStart = (otherStart + 1) % QUEUE_SIZE;
+			otherCount--;
+		}
+		else {
+			int key = pendingOrder[pendingStart];
+			pendingStart = (pendingStart + 1) % CC_KEYS;
+			pendingCount--;
+			message.setStatus(0xb);
+			message.setChannel(key / 128);
+			message.setNote(key % 128);
+			message.setValue(pendingValues[key]);
+			pendingValues[key] = -1;
+		}
+		output->sendRawMessageNow(message);
+		tokens -= 1.f;
+	}
+}
+
+rack::ui::Menu* MidiOutputRateItem::createChildMenu() {
+	rack::ui::Menu* menu = new rack::ui::Menu;
+
+	const int rates[5] = {0, 1000, 500, 250, 100};
+	for (int x = 0; x < 5; x++) {
+		MidiOutputRateValueItem* item = new MidiOutputRateValueItem;
+		item->output = output;
+		item->messagesPerSecond = rates[x];
+		item->text = rates[x] > 0 ? std::to_string(rates[x]) + " msg/s" : "Unlimited";
+		item->rightText = CHECKMARK(item->messagesPerSecond == output->scheduler.messagesPerSecond);
+		menu->addChild(item);
+	}
+
+	return menu;
+}
+
 
 rack::ui::Menu* MidiDriverItem::createChildMenu() {
 	rack::ui::Menu* menu = new rack::ui::Menu;
@@ -131,6 +300,14 @@ void MidiMenuBuilder::build(rack::ui::Menu* menu, MidiInputOutput* midiIO) {
 				menu->addChild(midiOutputChannelItem);
 			}
 
+			if(outputRate) {
+				MidiOutputRateItem* midiOutputRateItem = new MidiOutputRateItem;
+				midiOutputRateItem->text = "Output Rate";
+				midiOutputRateItem->rightText = RIGHT_ARROW;
+				midiOutputRateItem->output = &midiIO->output;
+				menu->addChild(midiOutputRateItem);
+			}
+
 		}
 
 }
\ No newline at end of file
@@ -1,18 +1,115 @@
 #pragma once
 
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <thread>
 #include "rack.hpp"
 
 struct MidiInput : rack::midi::InputQueue {
+	struct TimestampedMessage {
+		rack::midi::Message message;
+		int64_t frame;
+	};
+
+	// Sample counter of the owning module, used to timestamp incoming messages.
+	// Written by the engine thread, read by the MIDI driver thread.
+	std::atomic<int64_t> frame;
+
+	std::queue<TimestampedMessage> timestampedQueue;
+
+	MidiInput() {
+		frame = 0;
+	}
+
 	bool isConnected() {
 		return driverId > -1 && deviceId > -1;
 	}
+
+	void onMessage(rack::midi::Message message) override {
+		if((int) timestampedQueue.size() < queueMaxSize) {
+			timestampedQueue.push(TimestampedMessage{message, frame.load()});
+		}
+	}
+
+	// Hides InputQueue::shift, as messages are stored along their timestamp
+	bool shift(rack::midi::Message* message, int64_t* messageFrame = NULL) {
+		if(!message || timestampedQueue.empty()) return false;
+
+		*message = timestampedQueue.front().message;
+		if(messageFrame) *messageFrame = timestampedQueue.front().frame;
+		timestampedQueue.pop();
+		return true;
+	}
+};
+
+struct MidiOutput;
+
+// Queue of outgoing messages filled by the engine thread and drained by a
+// worker thread. Repeated CCs are coalesced to their latest value and the
+// output is throttled to a number of messages per second, so fast parameter
+// sweeps don't flood slow controllers.
+struct MidiOutputScheduler {
+	static const int QUEUE_SIZE = 1024; // Must be a power of 2 for RingBuffer thread safety
+	static const int CC_KEYS = 16 * 128; // Channel -> CC
+	static const int DEFAULT_RATE = 1000; // About the bandwidth of a DIN MIDI cable
+
+	MidiOutput* output;
+	// Set from the UI thread while a device is selected, the engine thread
+	// only queues messages then
+	std::atomic<bool> registered;
+
+	rack::dsp::RingBuffer<rack::midi::Message, QUEUE_SIZE> queue;
+
+	// Max messages per second, 0 = unlimited
+	std::atomic<int> messagesPerSecond;
+
+	// Consumer side, only touched by the worker thread
+	int16_t pendingValues[CC_KEYS];
+	uint16_t pendingOrder[CC_KEYS];
+	int pendingStart = 0;
+	int pendingCount = 0;
+	rack::midi::Message otherMessages[QUEUE_SIZE];
+	int otherStart = 0;
+	int otherCount = 0;
+	float tokens = 0.f;
+
+	// Channels on which the current (N)RPN sequence is being dropped, on the
+	// engine side of the queue and on the worker side
+	bool droppedPushedSequences[16];
+	bool droppedCoalescedSequences[16];
+
+	MidiOutputScheduler(MidiOutput* output_) {
+		output = output_;
+		registered = false;
+		messagesPerSecond = DEFAULT_RATE;
+		for(int x = 0; x < CC_KEYS; x++) pendingValues[x] = -1;
+		for(int c = 0; c < 16; c++) {
+			droppedPushedSequences[c] = false;
+			droppedCoalescedSequences[c] = false;
+		}
+	}
+
+	~MidiOutputScheduler();
+
+	void setActive(bool active);
+	void push(rack::midi::Message &message);
+	void process(float elapsed);
+	void coalesce(rack::midi::Message &message);
 };
 
 struct MidiOutput : rack::dsp::MidiGenerator<rack::PORT_MAX_CHANNELS>, rack::midi::Output {
+	MidiOutputScheduler scheduler;
+
+	MidiOutput() : scheduler(this) {}
+
 	bool isConnected() {
 		return driverId > -1 && deviceId > -1;
 	}
 
+	// Every device change goes through here, from the UI thread
+	void setDeviceId(int deviceId) override;
+
 	void onMessage(rack::midi::Message message) override {
 		rack::midi::Output::sendMessage(message);
 	}
@@ -22,8 +119,13 @@ struct MidiOutput : rack::dsp::MidiGenerator<rack::PORT_MAX_CHANNELS>, rack::mid
 		rack::dsp::MidiGenerator<rack::PORT_MAX_CHANNELS>::reset();
 	}
 
-	// Workaround for sending message on multiple channels
+	// Workaround for sending message on multiple channels. Messages are
+	// handed to the scheduler, which sends them from its own thread.
 	void sendRawMessage(rack::midi::Message &message) {
+		scheduler.push(message);
+	}
+
+	void sendRawMessageNow(rack::midi::Message &message) {
 		//DEBUG("Midi Message sent %02x %02x %02x", message.bytes[0], message.bytes[1], message.bytes[2]);
 		if (outputDevice) {
 			outputDevice->sendMessage(message);
@@ -46,14 +148,17 @@ struct MidiInputOutput {
 		json_t* rootJ = json_object();
 		json_object_set_new(rootJ, "midi_input", input.toJson());
 		json_object_set_new(rootJ, "midi_output", output.toJson());
+		json_object_set_new(rootJ, "midi_output_rate", json_integer(output.scheduler.messagesPerSecond));
 		return rootJ;
 	}
 
 	void fromJson(json_t* rootJ) {
 		json_t* midiInputJ = json_object_get(rootJ, "midi_input");
 		json_t* midiOutputJ = json_object_get(rootJ, "midi_output");
+		json_t* midiOutputRateJ = json_object_get(rootJ, "midi_output_rate");
 		if (midiInputJ) input.fromJson(midiInputJ);
 		if (midiOutputJ) output.fromJson(midiOutputJ);
+		if (midiOutputRateJ) output.scheduler.messagesPerSecond = json_integer_value(midiOutputRateJ);
 	}
 };
 
@@ -111,10 +216,26 @@ struct MidiChannelItem : rack::ui::MenuItem {
 	rack::ui::Menu* createChildMenu() override;
 };
 
+struct MidiOutputRateValueItem : rack::ui::MenuItem {
+	MidiOutput* output;
+	int messagesPerSecond;
+
+	void onAction(const rack::event::Action& e) override {
+		output->scheduler.messagesPerSecond = messagesPerSecond;
+	}
+};
+
+struct MidiOutputRateItem : rack::ui::MenuItem {
+	MidiOutput* output;
+
+	rack::ui::Menu* createChildMenu() override;
+};
+
 struct MidiMenuBuilder {
 	bool input = true;
 	bool output = true;
 	bool channel = true;
+	bool outputRate = false;
 	void build(rack::ui::Menu* menu, MidiInputOutput* midiIO);
 };
 
@@ -21,4 +21,58 @@ int rangeToIndex(float value, int size, float rangeMin, float rangeMax) {
 	float range = rangeMax - rangeMin;
 	float ratio = value / range;
 	return std::ceil(ratio * size) - 1;
-}
\ No newline at end of file
+}
+
+uint16_t floatToHalf(float value) {
+	uint32_t bits;
+	std::memcpy(&bits, &value, sizeof(bits));
+	uint16_t sign = (bits >> 16) & 0x8000;
+	uint32_t mantissa = bits & 0x7fffff;
+	int exponent = (int) ((bits >> 23) & 0xff) - 127 + 15;
+
+	// Infinity and NaN
+	if(((bits >> 23) & 0xff) == 0xff) return sign | 0x7c00 | (mantissa ? 0x200 : 0);
+	// Overflow
+	if(exponent >= 31) return sign | 0x7c00;
+
+	if(exponent <= 0) {
+		// Too small even for a subnormal
+		if(exponent < -10) return sign;
+		mantissa |= 0x800000;
+		int shift = 14 - exponent;
+		uint32_t half = mantissa >> shift;
+		uint32_t remainder = mantissa & ((1u << shift) - 1);
+		uint32_t halfway = 1u << (shift - 1);
+		if(remainder > halfway || (remainder == halfway && (half & 1))) half++;
+		return sign | half;
+	}
+
+	uint32_t half = ((uint32_t) exponent << 10) | (mantissa >> 13);
+	uint32_t remainder = mantissa & 0x1fff;
+	// A carry into the exponent still gives the right result, up to infinity
+	if(remainder > 0x1000 || (remainder == 0x1000 && (half & 1))) half++;
+	return sign | half;
+}
+
+float halfToFloat(uint16_t half) {
+	uint32_t sign = (uint32_t) (half & 0x8000) << 16;
+	uint32_t exponent = (half >> 10) & 0x1f;
+	uint32_t mantissa = half & 0x3ff;
+	uint32_t bits;
+
+	if(exponent == 0x1f) {
+		bits = sign | 0x7f800000 | (mantissa << 13);
+	}
+	else if(exponent == 0) {
+		// Zero or subnormal
+		float value = std::ldexp((float) mantissa, -24);
+		return sign ? -value : value;
+	}
+	else {
+		bits = sign | ((exponent + 112) << 23) | (mantissa << 13);
+	}
+
+	float value;
+	std::memcpy(&value, &bits, sizeof(value));
+	return value;
+}
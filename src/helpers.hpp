@@ -11,3 +11,8 @@ bool hasDecimals(float number);
 float round3(float number);
 
 int rangeToIndex(float value, int size, float rangeMin, float rangeMax);
+
+// IEEE 754 half precision conversions, rounding to nearest even
+uint16_t floatToHalf(float value);
+
+float halfToFloat(uint16_t half);